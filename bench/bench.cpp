@@ -0,0 +1,204 @@
+//
+// bench.cpp - compile-time benchmarks for the lexer, parser and codegen
+//
+// Every benchmark runs over a synthetic program generated up front, so the
+// numbers measure the compiler and not how the input was produced.
+//
+
+#include <deque>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#include "llvm/Support/Error.h"
+
+#include "CompilerSession.h"
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+// Synthetic programs
+//===----------------------------------------------------------------------===//
+
+/// keepAlive - a session's symbol table keeps spans into every source it has
+/// lexed, so generated programs have to outlive the sessions that used them
+static StringRef keepAlive(std::string Text) {
+    static std::deque<std::string> Programs;
+    return Programs.emplace_back(std::move(Text));
+}
+
+/// SyntheticExpr - generated source for a single expression and the number
+/// of AST nodes parsing it produces
+struct SyntheticExpr {
+    StringRef Text;
+    int64_t Nodes = 0;
+};
+
+/// makeBinopChain - "x + 1.5 * x - 2 < x ..." with Terms operands, mixing
+/// precedences so ParseBinopRhs both loops and recurses
+static SyntheticExpr makeBinopChain(int64_t Terms) {
+    static const char Ops[] = {'+', '*', '-', '*', '<'};
+    std::string Text;
+    for (int64_t I = 0; I != Terms; ++I) {
+        if (I) {
+            Text += ' ';
+            Text += Ops[I % sizeof(Ops)];
+            Text += ' ';
+        }
+        Text += I % 2 ? "x" : std::to_string(I) + ".5";
+    }
+    Text += ';';
+    // one leaf per term and one binary node between each pair
+    return {keepAlive(std::move(Text)), 2 * Terms - 1};
+}
+
+/// makeWideCall - "f(x, 1 + x, x, 3 + x, ...)" with Args arguments
+static SyntheticExpr makeWideCall(int64_t Args) {
+    std::string Text = "f(";
+    int64_t Nodes = 1;
+    for (int64_t I = 0; I != Args; ++I) {
+        if (I)
+            Text += ", ";
+        if (I % 2) {
+            Text += std::to_string(I) + " + x";
+            Nodes += 3;
+        } else {
+            Text += 'x';
+            Nodes += 1;
+        }
+    }
+    Text += ");";
+    return {keepAlive(std::move(Text)), Nodes};
+}
+
+/// TokensPerDefinition - what gettok returns for each of makeDefinitions'
+/// definitions, ';' included
+static constexpr int64_t TokensPerDefinition = 22;
+
+/// makeDefinitions - Defs independent definitions of a few operators each
+static StringRef makeDefinitions(int64_t Defs) {
+    std::string Text;
+    for (int64_t I = 0; I != Defs; ++I) {
+        std::string N = std::to_string(I);
+        Text += "def f" + N + "(a b) a * b + " + N + " - (a < b) * 2.5 * a;\n";
+    }
+    return keepAlive(std::move(Text));
+}
+
+//===----------------------------------------------------------------------===//
+// Benchmarks
+//===----------------------------------------------------------------------===//
+
+/// makeSession - a JIT session at Level, so codegen runs the same per-function
+/// pipeline as the REPL
+static std::unique_ptr<CompilerSession> makeSession(OptimizationLevel Level = OptimizationLevel::O2) {
+    static ExitOnError ExitOnErr("kaleido_bench: ");
+    SessionOptions Opts;
+    Opts.CodeGen.OptLevel = Level;
+    return ExitOnErr(CompilerSession::create(Opts));
+}
+
+/// BM_Lex - tokens/sec for gettok over Defs generated definitions
+static void BM_Lex(benchmark::State &State) {
+    StringRef Text = makeDefinitions(State.range(0));
+    auto Session = makeSession();
+    Lexer &Lex = Session->getLexer();
+    int64_t Tokens = 0;
+    for (auto _ : State) {
+        Session->openMemory(Text);
+        int64_t Pass = 0;
+        while (Lex.gettok() != tok_eof)
+            ++Pass;
+        if (Pass != TokensPerDefinition * State.range(0)) {
+            State.SkipWithError("the generated definitions lexed to the wrong number of tokens");
+            break;
+        }
+        Tokens += Pass;
+    }
+    State.counters["tokens/s"] = benchmark::Counter(static_cast<double>(Tokens), benchmark::Counter::kIsRate);
+    State.SetBytesProcessed(static_cast<int64_t>(State.iterations() * Text.size()));
+}
+BENCHMARK(BM_Lex)->Arg(100)->Arg(10000);
+
+/// runParseExpression - nodes/sec for ParseExpression over one expression
+static void runParseExpression(benchmark::State &State, const SyntheticExpr &E) {
+    auto Session = makeSession();
+    Parser &P = Session->getParser();
+    for (auto _ : State) {
+        Session->openMemory(E.Text);
+        P.getNextToken();
+        ExprAst *E = P.ParseExpression();
+        benchmark::DoNotOptimize(E);
+        Session->getAstContext().reset();
+        if (!E || P.getCurTok() != ';') {
+            State.SkipWithError("the generated expression did not parse");
+            break;
+        }
+    }
+    State.counters["nodes/s"] = benchmark::Counter(static_cast<double>(State.iterations() * E.Nodes),
+                                                   benchmark::Counter::kIsRate);
+}
+
+static void BM_ParseBinopChain(benchmark::State &State) {
+    runParseExpression(State, makeBinopChain(State.range(0)));
+}
+BENCHMARK(BM_ParseBinopChain)->Arg(100)->Arg(10000);
+
+static void BM_ParseWideCall(benchmark::State &State) {
+    runParseExpression(State, makeWideCall(State.range(0)));
+}
+BENCHMARK(BM_ParseWideCall)->Arg(100)->Arg(10000);
+
+/// BM_Codegen - functions/sec for FunctionAst::codegen, including the
+/// per-function pipeline at -O<range(1)>. Parsing is part of the loop but is
+/// small next to codegen; module setup is excluded.
+static void BM_Codegen(benchmark::State &State) {
+    static const OptimizationLevel Levels[] = {OptimizationLevel::O0, OptimizationLevel::O1,
+                                               OptimizationLevel::O2, OptimizationLevel::O3};
+    auto Session = makeSession(Levels[State.range(1)]);
+    Parser &P = Session->getParser();
+    AstContext &Ast = Session->getAstContext();
+    CodeGen &CG = Session->getCodeGen();
+
+    StringRef Text = makeDefinitions(State.range(0));
+    int64_t Functions = 0;
+    for (auto _ : State) {
+        State.PauseTiming();
+        CG.initializeModule();
+        State.ResumeTiming();
+
+        Session->openMemory(Text);
+        P.getNextToken();
+        while (P.getCurTok() != tok_eof) {
+            if (P.getCurTok() == ';') {
+                P.getNextToken();
+                continue;
+            }
+            auto *FnAST = P.ParseDefinition();
+            if (FnAST) {
+                FnAST->foldConstants(Ast);
+                if (!FnAST->codegen(CG))
+                    FnAST = nullptr;
+            }
+            Ast.reset();
+            if (!FnAST)
+                break;
+            ++Functions;
+        }
+        if (P.getCurTok() != tok_eof) {
+            State.SkipWithError("a generated definition did not compile");
+            break;
+        }
+    }
+    State.counters["functions/s"] = benchmark::Counter(static_cast<double>(Functions), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Codegen)->Args({1000, 0})->Args({1000, 2})->Unit(benchmark::kMillisecond);
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,479 @@
+//
+// AST.cpp - AST-level simplification, copying, printing and name checks
+//
+
+#include "AST.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Format.h"
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+// AST simplification
+//===----------------------------------------------------------------------===//
+
+ExprAst *ExprAst::fold(AstContext &Ctx) {
+    switch (getKind()) {
+        case EK_Num:
+        case EK_Var:
+            return this;
+        case EK_Bin:
+            return cast<BinExprAst>(this)->fold(Ctx);
+        case EK_Call:
+            return cast<CallExprAst>(this)->fold(Ctx);
+        case EK_If:
+            return cast<IfExprAst>(this)->fold(Ctx);
+        case EK_For:
+            return cast<ForExprAst>(this)->fold(Ctx);
+        case EK_VarIn:
+            return cast<VarInExprAst>(this)->fold(Ctx);
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+ExprAst *BinExprAst::fold(AstContext &Ctx) {
+    Lhs = Lhs->fold(Ctx);
+    Rhs = Rhs->fold(Ctx);
+
+    auto *L = dyn_cast<NumExprAst>(Lhs);
+    auto *R = dyn_cast<NumExprAst>(Rhs);
+
+    // both sides known: evaluate with the same semantics codegen would emit
+    if (L && R) {
+        double A = L->getVal(), B = R->getVal();
+        switch (Op) {
+            case '+':
+                return Ctx.newNode<NumExprAst>(A + B);
+            case '-':
+                return Ctx.newNode<NumExprAst>(A - B);
+            case '*':
+                return Ctx.newNode<NumExprAst>(A * B);
+            case '<':
+                // fcmp ult: true when unordered or less than
+                return Ctx.newNode<NumExprAst>(!(A >= B) ? 1.0 : 0.0);
+            default:
+                return this; // user-defined operators are calls
+        }
+    }
+
+    // identities that hold for every double, NaNs and signed zeros included.
+    // x + 0.0 and x * 0.0 are not among them.
+    auto IsPosZero = [](NumExprAst *N) { return N && N->getVal() == 0.0 && !std::signbit(N->getVal()); };
+    auto IsNegZero = [](NumExprAst *N) { return N && N->getVal() == 0.0 && std::signbit(N->getVal()); };
+    auto IsOne = [](NumExprAst *N) { return N && N->getVal() == 1.0; };
+    switch (Op) {
+        case '+':
+            if (IsNegZero(R))
+                return Lhs;
+            if (IsNegZero(L))
+                return Rhs;
+            break;
+        case '-':
+            if (IsPosZero(R))
+                return Lhs;
+            break;
+        case '*':
+            if (IsOne(R))
+                return Lhs;
+            if (IsOne(L))
+                return Rhs;
+            break;
+        default:
+            break;
+    }
+    return this;
+}
+
+void FunctionAst::foldConstants(AstContext &Ctx) {
+    PhaseTimer T(Ctx.getStats(), Phase::Fold);
+    Body = Body->fold(Ctx);
+}
+
+ExprAst *CallExprAst::fold(AstContext &Ctx) {
+    for (auto *&Arg : Args)
+        Arg = Arg->fold(Ctx);
+    return this;
+}
+
+ExprAst *IfExprAst::fold(AstContext &Ctx) {
+    Cond = Cond->fold(Ctx);
+    Then = Then->fold(Ctx);
+    Else = Else->fold(Ctx);
+    // a known condition picks its branch, as fcmp one would: NaN is false
+    if (auto *C = dyn_cast<NumExprAst>(Cond))
+        return !std::isnan(C->getVal()) && C->getVal() != 0.0 ? Then : Else;
+    return this;
+}
+
+ExprAst *ForExprAst::fold(AstContext &Ctx) {
+    Start = Start->fold(Ctx);
+    End = End->fold(Ctx);
+    Step = Step->fold(Ctx);
+    Body = Body->fold(Ctx);
+    return this;
+}
+
+ExprAst *VarInExprAst::fold(AstContext &Ctx) {
+    for (VarBinding &Var : Vars)
+        Var.Init = Var.Init->fold(Ctx);
+    Body = Body->fold(Ctx);
+    return this;
+}
+
+//===----------------------------------------------------------------------===//
+// Copying
+//===----------------------------------------------------------------------===//
+
+ExprAst *ExprAst::clone(AstContext &Ctx) const {
+    switch (getKind()) {
+        case EK_Num:
+            return Ctx.newNode<NumExprAst>(*cast<NumExprAst>(this));
+        case EK_Var:
+            return Ctx.newNode<VarExprAst>(*cast<VarExprAst>(this));
+        case EK_Bin:
+            return cast<BinExprAst>(this)->clone(Ctx);
+        case EK_Call:
+            return cast<CallExprAst>(this)->clone(Ctx);
+        case EK_If:
+            return cast<IfExprAst>(this)->clone(Ctx);
+        case EK_For:
+            return cast<ForExprAst>(this)->clone(Ctx);
+        case EK_VarIn:
+            return cast<VarInExprAst>(this)->clone(Ctx);
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+ExprAst *BinExprAst::clone(AstContext &Ctx) const {
+    return Ctx.newNode<BinExprAst>(Op, Lhs->clone(Ctx), Rhs->clone(Ctx), Callee);
+}
+
+ExprAst *CallExprAst::clone(AstContext &Ctx) const {
+    auto NewArgs = Ctx.newSpan<ExprAst *>(Args);
+    for (auto *&Arg : NewArgs)
+        Arg = Arg->clone(Ctx);
+    return Ctx.newNode<CallExprAst>(Callee, NewArgs);
+}
+
+ExprAst *IfExprAst::clone(AstContext &Ctx) const {
+    return Ctx.newNode<IfExprAst>(Cond->clone(Ctx), Then->clone(Ctx), Else->clone(Ctx));
+}
+
+ExprAst *ForExprAst::clone(AstContext &Ctx) const {
+    return Ctx.newNode<ForExprAst>(Var, Start->clone(Ctx), End->clone(Ctx), Step->clone(Ctx), Body->clone(Ctx));
+}
+
+ExprAst *VarInExprAst::clone(AstContext &Ctx) const {
+    auto NewVars = Ctx.newSpan<VarBinding>(Vars);
+    for (VarBinding &Var : NewVars)
+        Var.Init = Var.Init->clone(Ctx);
+    return Ctx.newNode<VarInExprAst>(NewVars, Body->clone(Ctx));
+}
+
+PrototypeAst *PrototypeAst::clone(AstContext &Ctx) const {
+    return Ctx.newNode<PrototypeAst>(Name, Ctx.newSpan<Symbol>(Args), Pure, Memo);
+}
+
+FunctionAst *FunctionAst::clone(AstContext &Ctx) const {
+    return Ctx.newNode<FunctionAst>(Proto->clone(Ctx), Body->clone(Ctx));
+}
+
+//===----------------------------------------------------------------------===//
+// Printing and call edges
+//===----------------------------------------------------------------------===//
+
+void ExprAst::print(raw_ostream &OS, const SymbolTable &Symbols) const {
+    switch (getKind()) {
+        case EK_Num:
+            // exact, so distinct constants never print alike
+            OS << format("%a", cast<NumExprAst>(this)->getVal());
+            return;
+        case EK_Var:
+            OS << Symbols.name(cast<VarExprAst>(this)->getName());
+            return;
+        case EK_Bin:
+            return cast<BinExprAst>(this)->print(OS, Symbols);
+        case EK_Call:
+            return cast<CallExprAst>(this)->print(OS, Symbols);
+        case EK_If:
+            return cast<IfExprAst>(this)->print(OS, Symbols);
+        case EK_For:
+            return cast<ForExprAst>(this)->print(OS, Symbols);
+        case EK_VarIn:
+            return cast<VarInExprAst>(this)->print(OS, Symbols);
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+void BinExprAst::print(raw_ostream &OS, const SymbolTable &Symbols) const {
+    OS << '(' << Op << ' ';
+    Lhs->print(OS, Symbols);
+    OS << ' ';
+    Rhs->print(OS, Symbols);
+    OS << ')';
+}
+
+void CallExprAst::print(raw_ostream &OS, const SymbolTable &Symbols) const {
+    OS << "(call " << Symbols.name(Callee);
+    for (auto *Arg : Args) {
+        OS << ' ';
+        Arg->print(OS, Symbols);
+    }
+    OS << ')';
+}
+
+void IfExprAst::print(raw_ostream &OS, const SymbolTable &Symbols) const {
+    OS << "(if ";
+    Cond->print(OS, Symbols);
+    OS << ' ';
+    Then->print(OS, Symbols);
+    OS << ' ';
+    Else->print(OS, Symbols);
+    OS << ')';
+}
+
+void ForExprAst::print(raw_ostream &OS, const SymbolTable &Symbols) const {
+    OS << "(for " << Symbols.name(Var);
+    for (const ExprAst *E : {Start, End, Step, Body}) {
+        OS << ' ';
+        E->print(OS, Symbols);
+    }
+    OS << ')';
+}
+
+void VarInExprAst::print(raw_ostream &OS, const SymbolTable &Symbols) const {
+    OS << "(var";
+    for (const VarBinding &Var : Vars) {
+        OS << " (" << Symbols.name(Var.Name) << ' ';
+        Var.Init->print(OS, Symbols);
+        OS << ')';
+    }
+    OS << ' ';
+    Body->print(OS, Symbols);
+    OS << ')';
+}
+
+void PrototypeAst::print(raw_ostream &OS, const SymbolTable &Symbols) const {
+    if (Pure)
+        OS << "pure ";
+    if (Memo)
+        OS << "memo ";
+    OS << Symbols.name(Name) << '(';
+    ListSeparator LS(" ");
+    for (Symbol Arg : Args)
+        OS << LS << Symbols.name(Arg);
+    OS << ')';
+}
+
+void FunctionAst::print(raw_ostream &OS, const SymbolTable &Symbols) const {
+    OS << "def ";
+    Proto->print(OS, Symbols);
+    OS << ' ';
+    Body->print(OS, Symbols);
+}
+
+void ExprAst::collectCallees(SmallVectorImpl<Symbol> &Callees) const {
+    switch (getKind()) {
+        case EK_Num:
+        case EK_Var:
+            return;
+        case EK_Bin:
+            return cast<BinExprAst>(this)->collectCallees(Callees);
+        case EK_Call:
+            return cast<CallExprAst>(this)->collectCallees(Callees);
+        case EK_If:
+            return cast<IfExprAst>(this)->collectCallees(Callees);
+        case EK_For:
+            return cast<ForExprAst>(this)->collectCallees(Callees);
+        case EK_VarIn:
+            return cast<VarInExprAst>(this)->collectCallees(Callees);
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+void BinExprAst::collectCallees(SmallVectorImpl<Symbol> &Callees) const {
+    if (Callee)
+        Callees.push_back(*Callee);
+    Lhs->collectCallees(Callees);
+    Rhs->collectCallees(Callees);
+}
+
+void CallExprAst::collectCallees(SmallVectorImpl<Symbol> &Callees) const {
+    Callees.push_back(Callee);
+    for (auto *Arg : Args)
+        Arg->collectCallees(Callees);
+}
+
+void IfExprAst::collectCallees(SmallVectorImpl<Symbol> &Callees) const {
+    Cond->collectCallees(Callees);
+    Then->collectCallees(Callees);
+    Else->collectCallees(Callees);
+}
+
+void ForExprAst::collectCallees(SmallVectorImpl<Symbol> &Callees) const {
+    for (const ExprAst *E : {Start, End, Step, Body})
+        E->collectCallees(Callees);
+}
+
+void VarInExprAst::collectCallees(SmallVectorImpl<Symbol> &Callees) const {
+    for (const VarBinding &Var : Vars)
+        Var.Init->collectCallees(Callees);
+    Body->collectCallees(Callees);
+}
+
+void FunctionAst::getCallees(SmallVectorImpl<Symbol> &Callees) const {
+    Body->collectCallees(Callees);
+    llvm::sort(Callees);
+    Callees.erase(std::unique(Callees.begin(), Callees.end()), Callees.end());
+}
+
+bool ExprAst::hasLoop() const {
+    switch (getKind()) {
+        case EK_Num:
+        case EK_Var:
+            return false;
+        case EK_Bin:
+            return cast<BinExprAst>(this)->hasLoop();
+        case EK_Call:
+            return cast<CallExprAst>(this)->hasLoop();
+        case EK_If:
+            return cast<IfExprAst>(this)->hasLoop();
+        case EK_For:
+            return cast<ForExprAst>(this)->hasLoop();
+        case EK_VarIn:
+            return cast<VarInExprAst>(this)->hasLoop();
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+bool BinExprAst::hasLoop() const {
+    return Lhs->hasLoop() || Rhs->hasLoop();
+}
+
+bool CallExprAst::hasLoop() const {
+    return any_of(Args, [](const ExprAst *Arg) { return Arg->hasLoop(); });
+}
+
+bool IfExprAst::hasLoop() const {
+    return Cond->hasLoop() || Then->hasLoop() || Else->hasLoop();
+}
+
+bool ForExprAst::hasLoop() const {
+    return true;
+}
+
+bool VarInExprAst::hasLoop() const {
+    return Body->hasLoop() || any_of(Vars, [](const VarBinding &Var) { return Var.Init->hasLoop(); });
+}
+
+//===----------------------------------------------------------------------===//
+// Name checks
+//===----------------------------------------------------------------------===//
+
+// each check mirrors codegen's, with its message, in the order codegen
+// visits the tree
+
+const char *NameChecker::check(const FunctionAst &Fn) {
+    Vars.assign(Fn.getProto().getArgs().begin(), Fn.getProto().getArgs().end());
+    const char *Err = Fn.getBody().checkNames(*this);
+    Vars.clear();
+    return Err;
+}
+
+const char *NameChecker::checkCall(Symbol Callee, size_t NumArgs) const {
+    const PrototypeAst *Proto = Lookup(Callee);
+    if (Proto && Proto->getArgs().size() != NumArgs)
+        return "Incorrect # args passed";
+    return nullptr;
+}
+
+const char *ExprAst::checkNames(NameChecker &C) const {
+    switch (getKind()) {
+        case EK_Num:
+            return nullptr;
+        case EK_Var:
+            return cast<VarExprAst>(this)->checkNames(C);
+        case EK_Bin:
+            return cast<BinExprAst>(this)->checkNames(C);
+        case EK_Call:
+            return cast<CallExprAst>(this)->checkNames(C);
+        case EK_If:
+            return cast<IfExprAst>(this)->checkNames(C);
+        case EK_For:
+            return cast<ForExprAst>(this)->checkNames(C);
+        case EK_VarIn:
+            return cast<VarInExprAst>(this)->checkNames(C);
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+const char *VarExprAst::checkNames(NameChecker &C) const {
+    return C.inScope(Name) ? nullptr : "Unknown variable name";
+}
+
+const char *BinExprAst::checkNames(NameChecker &C) const {
+    if (Op == '=') {
+        auto *Dest = dyn_cast<VarExprAst>(Lhs);
+        if (!Dest)
+            return "destination of '=' must be a variable";
+        if (const char *Err = Rhs->checkNames(C))
+            return Err;
+        return Dest->checkNames(C);
+    }
+    if (const char *Err = Lhs->checkNames(C))
+        return Err;
+    if (const char *Err = Rhs->checkNames(C))
+        return Err;
+    if (Callee && C.checkCall(*Callee, 2))
+        return "invalid binary operator";
+    return nullptr;
+}
+
+const char *CallExprAst::checkNames(NameChecker &C) const {
+    if (const char *Err = C.checkCall(Callee, Args.size()))
+        return Err;
+    for (const ExprAst *Arg : Args)
+        if (const char *Err = Arg->checkNames(C))
+            return Err;
+    return nullptr;
+}
+
+const char *IfExprAst::checkNames(NameChecker &C) const {
+    for (const ExprAst *E : {Cond, Then, Else})
+        if (const char *Err = E->checkNames(C))
+            return Err;
+    return nullptr;
+}
+
+const char *ForExprAst::checkNames(NameChecker &C) const {
+    if (const char *Err = Start->checkNames(C))
+        return Err;
+    size_t Mark = C.scope();
+    C.bind(Var);
+    const char *Err = nullptr;
+    for (const ExprAst *E : {End, Body, Step})
+        if (!Err)
+            Err = E->checkNames(C);
+    C.unbind(Mark);
+    return Err;
+}
+
+const char *VarInExprAst::checkNames(NameChecker &C) const {
+    size_t Mark = C.scope();
+    const char *Err = nullptr;
+    for (const VarBinding &V : Vars) {
+        // the initialiser is checked before V is in scope, as it is generated
+        if ((Err = V.Init->checkNames(C)))
+            break;
+        C.bind(V.Name);
+    }
+    if (!Err)
+        Err = Body->checkNames(C);
+    C.unbind(Mark);
+    return Err;
+}
@@ -0,0 +1,336 @@
+//
+// AST.h - arena-allocated syntax tree
+//
+
+#ifndef KALEIDO_AST_H
+#define KALEIDO_AST_H
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Value.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Lexer.h"
+#include "Stats.h"
+
+class AstContext;
+class CodeGen;
+class Interpreter;
+class NameChecker;
+class PrototypeAst;
+
+/// ExprAst - Base class for all expression nodes. Nodes live in the AST arena
+/// and are released all at once, so there is no vtable; the kind tag drives
+/// dispatch and isa<>/cast<> instead.
+class ExprAst {
+public:
+    enum ExprKind : uint8_t {
+        EK_Num,
+        EK_Var,
+        EK_Bin,
+        EK_Call,
+        EK_If,
+        EK_For,
+        EK_VarIn,
+    };
+private:
+    const ExprKind Kind;
+protected:
+    ExprAst(ExprKind Kind) : Kind(Kind) {};
+public:
+    [[nodiscard]] ExprKind getKind() const { return Kind; };
+
+    /// fold - simplify this subtree, returning its replacement
+    ExprAst *fold(AstContext &Ctx);
+    /// clone - deep copy of this subtree in Ctx
+    ExprAst *clone(AstContext &Ctx) const;
+    /// print - canonical text of this subtree, identical for sources that
+    /// differ only in layout and comments
+    void print(llvm::raw_ostream &OS, const SymbolTable &Symbols) const;
+    /// collectCallees - append the callee of every call in this subtree
+    void collectCallees(llvm::SmallVectorImpl<Symbol> &Callees) const;
+    /// hasLoop - whether this subtree has a for loop in it
+    bool hasLoop() const;
+    /// checkNames - see NameChecker; the first error codegen would report
+    /// for this subtree, or null
+    const char *checkNames(NameChecker &C) const;
+    /// canInterpret/interpret - see Interpreter; loops are always compiled
+    bool canInterpret(Interpreter &I) const;
+    double interpret(Interpreter &I) const;
+    llvm::Value *codegen(CodeGen &CG);
+};
+
+/// NumberExprAst - Expression class for numeric literals
+class NumExprAst : public ExprAst {
+    double Val;
+public:
+    NumExprAst(double Val) : ExprAst(EK_Num), Val(Val) {};
+
+    [[nodiscard]] double getVal() const { return Val; };
+
+    static bool classof(const ExprAst *E) { return E->getKind() == EK_Num; };
+    bool canInterpret(Interpreter &I) const;
+    double interpret(Interpreter &I) const;
+    llvm::Value* codegen(CodeGen &CG);
+};
+
+///  VarExprAst - class for refing a var
+class VarExprAst : public ExprAst {
+    Symbol Name;
+public:
+    VarExprAst(Symbol Name) : ExprAst(EK_Var), Name(Name) {};
+
+    [[nodiscard]] Symbol getName() const { return Name; };
+
+    static bool classof(const ExprAst *E) { return E->getKind() == EK_Var; };
+    const char *checkNames(NameChecker &C) const;
+    bool canInterpret(Interpreter &I) const;
+    double interpret(Interpreter &I) const;
+    llvm::Value* codegen(CodeGen &CG);
+};
+
+/// BinExprAst - Expression for binary ops. '=' assigns to the variable on
+/// its left and yields the value stored. A user-defined operator is a call
+/// to Callee, the function "binary" followed by the operator character.
+class BinExprAst : public ExprAst {
+    char Op;
+    ExprAst *Lhs, *Rhs;
+    std::optional<Symbol> Callee;
+public:
+    BinExprAst(char Op, ExprAst *Lhs, ExprAst *Rhs, std::optional<Symbol> Callee = std::nullopt)
+            : ExprAst(EK_Bin), Op(Op), Lhs(Lhs), Rhs(Rhs), Callee(Callee) {};
+
+    [[nodiscard]] std::optional<Symbol> getCallee() const { return Callee; }
+
+    static bool classof(const ExprAst *E) { return E->getKind() == EK_Bin; };
+    ExprAst *fold(AstContext &Ctx);
+    ExprAst *clone(AstContext &Ctx) const;
+    void print(llvm::raw_ostream &OS, const SymbolTable &Symbols) const;
+    void collectCallees(llvm::SmallVectorImpl<Symbol> &Callees) const;
+    bool hasLoop() const;
+    const char *checkNames(NameChecker &C) const;
+    bool canInterpret(Interpreter &I) const;
+    double interpret(Interpreter &I) const;
+    llvm::Value* codegen(CodeGen &CG);
+};
+
+/// CallExprAst - Expression class for function calls. The arguments are one
+/// contiguous span in the arena.
+class CallExprAst : public ExprAst {
+    Symbol Callee;
+    llvm::MutableArrayRef<ExprAst *> Args;
+public:
+    CallExprAst(Symbol Callee, llvm::MutableArrayRef<ExprAst *> Args)
+            : ExprAst(EK_Call), Callee(Callee), Args(Args) {};
+
+    static bool classof(const ExprAst *E) { return E->getKind() == EK_Call; };
+    ExprAst *fold(AstContext &Ctx);
+    ExprAst *clone(AstContext &Ctx) const;
+    void print(llvm::raw_ostream &OS, const SymbolTable &Symbols) const;
+    void collectCallees(llvm::SmallVectorImpl<Symbol> &Callees) const;
+    bool hasLoop() const;
+    const char *checkNames(NameChecker &C) const;
+    bool canInterpret(Interpreter &I) const;
+    double interpret(Interpreter &I) const;
+    llvm::Value* codegen(CodeGen &CG);
+};
+
+/// IfExprAst - if/then/else, taking the then branch when Cond is non-zero
+class IfExprAst : public ExprAst {
+    ExprAst *Cond, *Then, *Else;
+public:
+    IfExprAst(ExprAst *Cond, ExprAst *Then, ExprAst *Else)
+            : ExprAst(EK_If), Cond(Cond), Then(Then), Else(Else) {};
+
+    static bool classof(const ExprAst *E) { return E->getKind() == EK_If; };
+    ExprAst *fold(AstContext &Ctx);
+    ExprAst *clone(AstContext &Ctx) const;
+    void print(llvm::raw_ostream &OS, const SymbolTable &Symbols) const;
+    void collectCallees(llvm::SmallVectorImpl<Symbol> &Callees) const;
+    bool hasLoop() const;
+    const char *checkNames(NameChecker &C) const;
+    bool canInterpret(Interpreter &I) const;
+    double interpret(Interpreter &I) const;
+    llvm::Value* codegen(CodeGen &CG);
+};
+
+/// ForExprAst - for Var = Start, End, Step in Body. End is tested before
+/// every iteration, Step is added after it, and the loop yields 0.0.
+class ForExprAst : public ExprAst {
+    Symbol Var;
+    ExprAst *Start, *End, *Step, *Body;
+public:
+    ForExprAst(Symbol Var, ExprAst *Start, ExprAst *End, ExprAst *Step, ExprAst *Body)
+            : ExprAst(EK_For), Var(Var), Start(Start), End(End), Step(Step), Body(Body) {};
+
+    static bool classof(const ExprAst *E) { return E->getKind() == EK_For; };
+    ExprAst *fold(AstContext &Ctx);
+    ExprAst *clone(AstContext &Ctx) const;
+    void print(llvm::raw_ostream &OS, const SymbolTable &Symbols) const;
+    void collectCallees(llvm::SmallVectorImpl<Symbol> &Callees) const;
+    bool hasLoop() const;
+    const char *checkNames(NameChecker &C) const;
+    llvm::Value* codegen(CodeGen &CG);
+};
+
+/// VarBinding - one local of a var/in, with the value it starts out with
+struct VarBinding {
+    Symbol Name;
+    ExprAst *Init;
+};
+
+/// VarInExprAst - var a = x, b = y in Body. Each initialiser sees the
+/// locals bound before it, and the locals shadow any outer variable of the
+/// same name until Body ends.
+class VarInExprAst : public ExprAst {
+    llvm::MutableArrayRef<VarBinding> Vars;
+    ExprAst *Body;
+public:
+    VarInExprAst(llvm::MutableArrayRef<VarBinding> Vars, ExprAst *Body)
+            : ExprAst(EK_VarIn), Vars(Vars), Body(Body) {};
+
+    static bool classof(const ExprAst *E) { return E->getKind() == EK_VarIn; };
+    ExprAst *fold(AstContext &Ctx);
+    ExprAst *clone(AstContext &Ctx) const;
+    void print(llvm::raw_ostream &OS, const SymbolTable &Symbols) const;
+    void collectCallees(llvm::SmallVectorImpl<Symbol> &Callees) const;
+    bool hasLoop() const;
+    const char *checkNames(NameChecker &C) const;
+    bool canInterpret(Interpreter &I) const;
+    double interpret(Interpreter &I) const;
+    llvm::Value* codegen(CodeGen &CG);
+};
+
+/// PrototypeAst - this class represents the prototype for a function,
+/// which captures its name, and its argument names. An extern can be
+/// declared pure: it touches no memory and always returns, so calls to it
+/// can be merged. A memo definition keeps the results of earlier calls in a
+/// table.
+class PrototypeAst {
+    Symbol Name;
+    llvm::ArrayRef<Symbol> Args;
+    bool Pure;
+    bool Memo;
+public:
+    PrototypeAst(Symbol Name, llvm::ArrayRef<Symbol> Args, bool Pure = false, bool Memo = false)
+            : Name(Name), Args(Args), Pure(Pure), Memo(Memo) {};
+
+    [[nodiscard]] Symbol getSymbol() const { return Name; };
+    [[nodiscard]] llvm::ArrayRef<Symbol> getArgs() const { return Args; };
+    [[nodiscard]] bool isPure() const { return Pure; };
+    [[nodiscard]] bool isMemo() const { return Memo; };
+
+    PrototypeAst *clone(AstContext &Ctx) const;
+    void print(llvm::raw_ostream &OS, const SymbolTable &Symbols) const;
+    llvm::Function *codegen(CodeGen &CG);
+};
+
+/// FunctionAst - This class represents a function definition itself
+class FunctionAst {
+    PrototypeAst *Proto;
+    ExprAst *Body;
+public:
+    FunctionAst(PrototypeAst *Proto, ExprAst *Body)
+            : Proto(Proto), Body(Body) {};
+
+    [[nodiscard]] const PrototypeAst &getProto() const { return *Proto; };
+    [[nodiscard]] const ExprAst &getBody() const { return *Body; };
+
+    /// foldConstants - collapse constant subtrees of the body before codegen
+    void foldConstants(AstContext &Ctx);
+    /// clone - deep copy in Ctx, for definitions that outlive their item
+    FunctionAst *clone(AstContext &Ctx) const;
+    void print(llvm::raw_ostream &OS, const SymbolTable &Symbols) const;
+    /// getCallees - every function the body calls, each listed once
+    void getCallees(llvm::SmallVectorImpl<Symbol> &Callees) const;
+    llvm::Function *codegen(CodeGen &CG);
+private:
+    /// codegenMap - the <name>_map wrapper: the body again, inlined into a
+    /// loop over input columns so that it can be vectorised
+    llvm::Function *codegenMap(CodeGen &CG);
+};
+
+/// NameChecker - finds what codegen would reject in a body by looking at
+/// names alone: unknown variables, and calls with the wrong number of
+/// arguments. A function with no prototype yet may still be defined before
+/// the body is generated, so calls to it pass. Lazy definitions are checked
+/// with it as they are entered, since their bodies are generated when first
+/// called.
+class NameChecker {
+public:
+    /// PrototypeLookup - the prototype a call to Name would use, or null
+    using PrototypeLookup = llvm::function_ref<const PrototypeAst *(Symbol Name)>;
+private:
+    PrototypeLookup Lookup;
+    /// Vars - the variables in scope, innermost last
+    llvm::SmallVector<Symbol, 8> Vars;
+public:
+    explicit NameChecker(PrototypeLookup Lookup) : Lookup(Lookup) {}
+
+    /// check - the first error codegen would report for Fn, or null
+    const char *check(const FunctionAst &Fn);
+
+    // what the nodes check themselves with
+
+    /// checkCall - the error for calling Callee with NumArgs arguments, if
+    /// Callee is known
+    const char *checkCall(Symbol Callee, size_t NumArgs) const;
+    [[nodiscard]] bool inScope(Symbol Name) const { return llvm::is_contained(Vars, Name); }
+    /// bind/unbind - bring a variable into scope, and drop every variable
+    /// bound since the scope had Mark of them
+    [[nodiscard]] size_t scope() const { return Vars.size(); }
+    void bind(Symbol Name) { Vars.push_back(Name); }
+    void unbind(size_t Mark) { Vars.truncate(Mark); }
+};
+
+/// newSpan - copy a list of children into Arena as one contiguous span
+template <typename T>
+llvm::MutableArrayRef<T> newSpan(llvm::ArrayRef<T> Elts, llvm::BumpPtrAllocator &Arena) {
+    if (Elts.empty())
+        return {};
+    T *Mem = Arena.Allocate<T>(Elts.size());
+    std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+    return {Mem, Elts.size()};
+}
+
+/// AstContext - bump allocator backing every node of the top-level item being
+/// parsed. The session resets it once the item is handled, which frees the
+/// whole tree without visiting it.
+class AstContext {
+    llvm::BumpPtrAllocator Arena;
+    RunStats &Stats;
+public:
+    explicit AstContext(RunStats &Stats) : Stats(Stats) {}
+
+    [[nodiscard]] RunStats &getStats() { return Stats; }
+
+    /// newNode - construct an AST node in the arena
+    template <typename T, typename... ArgTs>
+    T *newNode(ArgTs &&...Args) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena nodes are never destroyed");
+        ++Stats.AstNodes;
+        return new (Arena.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+    }
+
+    /// newSpan - copy a list of children into the arena
+    template <typename T>
+    llvm::MutableArrayRef<T> newSpan(llvm::ArrayRef<T> Elts) {
+        return ::newSpan(Elts, Arena);
+    }
+
+    /// reset - free every node allocated so far
+    void reset() { Arena.Reset(); }
+};
+
+#endif // KALEIDO_AST_H
@@ -0,0 +1,905 @@
+//
+// CodeGen.cpp - LLVM IR generation and optimisation
+//
+
+#include "CodeGen.h"
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+
+using namespace llvm;
+
+CodeGen::CodeGen(const CodegenOptions &Opts, SymbolTable &Symbols, Diagnostics &Diags, RunStats &Stats)
+        : Opts(Opts), Symbols(Symbols), Diags(Diags), Stats(Stats) {}
+
+CodeGen::~CodeGen() = default;
+
+void CodeGen::recordPrototype(const PrototypeAst &P) {
+    PrototypeAst Saved(P.getSymbol(), newSpan(P.getArgs(), ProtoArena), P.isPure(), P.isMemo());
+    auto [It, Inserted] = FunctionProtos.try_emplace(P.getSymbol(), Saved);
+    if (!Inserted)
+        It->second = Saved;
+    // a body, if there is one, is only known once it is generated
+    if (P.isPure())
+        Effects[P.getSymbol()] = {true, true, true};
+    else
+        Effects.erase(P.getSymbol());
+}
+
+Function *CodeGen::getFunction(Symbol Name) {
+    WeakVH &Cached = ModuleFunctions[Name];
+    if (Cached)
+        return cast<Function>(Cached);
+
+    Function *F = TheModule->getFunction(Symbols.name(Name));
+    if (!F) {
+        auto FI = FunctionProtos.find(Name);
+        if (FI != FunctionProtos.end())
+            F = FI->second.codegen(*this);
+    }
+    Cached = F;
+    return F;
+}
+
+FunctionCallee CodeGen::getCallee(Symbol Name, Function *F) {
+    auto It = BoundAddresses.find(Name);
+    if (It == BoundAddresses.end())
+        return F;
+    Type *IntPtrTy = TheModule->getDataLayout().getIntPtrType(*TheContext);
+    Constant *Addr = ConstantExpr::getIntToPtr(ConstantInt::get(IntPtrTy, It->second), F->getType());
+    return {F->getFunctionType(), Addr};
+}
+
+AllocaInst *CodeGen::createEntryBlockAlloca(Function *F, Symbol Name) {
+    IRBuilder<> TmpB(&F->getEntryBlock(), F->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr, Symbols.name(Name));
+}
+
+Value *CodeGen::error(const char *Str) {
+    Diags.error(Str);
+    return nullptr;
+}
+
+void CodeGen::optimize(Function &F) {
+    if (Opts.Batch)
+        return;
+    PhaseTimer T(Stats, Phase::Optimize);
+    TheFPM->run(F, *TheFAM);
+    Stats.OptimizedInstructions += F.getInstructionCount();
+}
+
+/// addEffectAttributes - the attributes E allows on F or on a call
+template <typename T>
+static void addEffectAttributes(T &FnOrCall, FunctionEffects E) {
+    if (E.Pure)
+        FnOrCall.setDoesNotThrow();
+    if (E.NoMemory)
+        FnOrCall.setDoesNotAccessMemory();
+    if (E.Returns)
+        FnOrCall.addFnAttr(Attribute::WillReturn);
+}
+
+CallInst *CodeGen::createCall(Symbol Name, Function *F, ArrayRef<Value *> Args, const Twine &ValName) {
+    CallInst *CI = Builder->CreateCall(getCallee(Name, F), Args, ValName);
+    // F itself gets its attributes once its body is done
+    if (Name == EffectsOf) {
+        BodyEffects.Returns = false;
+        return CI;
+    }
+    FunctionEffects E = getEffects(Name);
+    BodyEffects.Pure &= E.Pure;
+    BodyEffects.NoMemory &= E.NoMemory;
+    BodyEffects.Returns &= E.Returns;
+    // a bound call goes to an address, which has no attributes of its own
+    addEffectAttributes(*CI, E);
+    return CI;
+}
+
+void CodeGen::beginEffects(Symbol Name) {
+    EffectsOf = Name;
+    // instrumented code writes its counters
+    BodyEffects = {true, Opts.MarkReadNone && !Instrument, true};
+}
+
+FunctionEffects CodeGen::predictEffects(const FunctionAst &Fn) const {
+    // the same rules as createCall, noteLoop and the memo table
+    Symbol Name = Fn.getProto().getSymbol();
+    FunctionEffects E = {true, Opts.MarkReadNone, true};
+    SmallVector<Symbol, 8> Callees;
+    Fn.getCallees(Callees);
+    for (Symbol Callee : Callees) {
+        if (Callee == Name) {
+            E.Returns = false;
+            continue;
+        }
+        FunctionEffects C = getEffects(Callee);
+        E.Pure &= C.Pure;
+        E.NoMemory &= C.NoMemory;
+        E.Returns &= C.Returns;
+    }
+    if (Fn.getBody().hasLoop())
+        E.Returns = false;
+    if (Fn.getProto().isMemo())
+        E.NoMemory = false;
+    return E;
+}
+
+void CodeGen::optimizeMap(Function &F) {
+    if (Opts.Batch)
+        return;
+    PhaseTimer T(Stats, Phase::Optimize);
+    TheMapFPM->run(F, *TheFAM);
+    Stats.OptimizedInstructions += F.getInstructionCount();
+}
+
+void CodeGen::beginProfile(const FunctionAst &Fn, bool Count) {
+    NextCounter = 0;
+    // a top-level expression runs once, so counting it says nothing
+    Profiling = Prof && Fn.getProto().getSymbol() != SymAnon;
+    Counting = Profiling && Count && Instrument;
+    if (!Profiling)
+        return;
+
+    std::string Text;
+    raw_string_ostream OS(Text);
+    Fn.print(OS, Symbols);
+    OS.flush();
+    ProfileName = Symbols.name(Fn.getProto().getSymbol());
+    ProfileHash = xxHash64(Text);
+    ProfileCounts = Prof->getCounts(ProfileName, ProfileHash);
+}
+
+void CodeGen::countHere(unsigned Idx) {
+    if (!Counting)
+        return;
+    // the counter lives in the session, so its address is a constant
+    uint64_t *Counter = Prof->getCounter(ProfileName, ProfileHash, Idx);
+    Type *Int64Ty = Type::getInt64Ty(*TheContext);
+    Type *IntPtrTy = TheModule->getDataLayout().getIntPtrType(*TheContext);
+    Constant *Addr = ConstantExpr::getIntToPtr(ConstantInt::get(IntPtrTy, reinterpret_cast<uintptr_t>(Counter)),
+                                               PointerType::getUnqual(Int64Ty));
+    Value *Old = Builder->CreateLoad(Int64Ty, Addr, "prof");
+    Builder->CreateStore(Builder->CreateAdd(Old, ConstantInt::get(Int64Ty, 1)), Addr);
+}
+
+std::optional<uint64_t> CodeGen::getProfileCount(unsigned Idx) const {
+    if (!Profiling || Idx >= ProfileCounts.size())
+        return std::nullopt;
+    return ProfileCounts[Idx];
+}
+
+MDNode *CodeGen::getBranchWeights(unsigned Idx) {
+    std::optional<uint64_t> True = getProfileCount(Idx), False = getProfileCount(Idx + 1);
+    if (!True || !False || (!*True && !*False))
+        return nullptr;
+    // weights are 32 bits wide, so scale both sides down alike
+    uint64_t Scale = std::max(*True, *False) / UINT32_MAX + 1;
+    return MDBuilder(*TheContext).createBranchWeights(*True / Scale, *False / Scale);
+}
+
+Value* ExprAst::codegen(CodeGen &CG) {
+    switch (getKind()) {
+        case EK_Num:
+            return cast<NumExprAst>(this)->codegen(CG);
+        case EK_Var:
+            return cast<VarExprAst>(this)->codegen(CG);
+        case EK_Bin:
+            return cast<BinExprAst>(this)->codegen(CG);
+        case EK_Call:
+            return cast<CallExprAst>(this)->codegen(CG);
+        case EK_If:
+            return cast<IfExprAst>(this)->codegen(CG);
+        case EK_For:
+            return cast<ForExprAst>(this)->codegen(CG);
+        case EK_VarIn:
+            return cast<VarInExprAst>(this)->codegen(CG);
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+Value* NumExprAst::codegen(CodeGen &CG) {
+    return ConstantFP::get(CG.getContext(), APFloat(Val));
+}
+
+Value* VarExprAst::codegen(CodeGen &CG) {
+    AllocaInst *A = CG.getNamedValues().lookup(Name);
+    if (!A)
+        return CG.error("Unknown variable name");
+    return CG.getBuilder().CreateLoad(A->getAllocatedType(), A, CG.getSymbols().name(Name));
+}
+
+Value* BinExprAst::codegen(CodeGen &CG) {
+    // assignment does not evaluate its left side
+    if (Op == '=') {
+        auto *Dest = dyn_cast<VarExprAst>(Lhs);
+        if (!Dest)
+            return CG.error("destination of '=' must be a variable");
+        Value *Val = Rhs->codegen(CG);
+        if (!Val)
+            return nullptr;
+        AllocaInst *Var = CG.getNamedValues().lookup(Dest->getName());
+        if (!Var)
+            return CG.error("Unknown variable name");
+        CG.getBuilder().CreateStore(Val, Var);
+        return Val;
+    }
+
+    Value *L = Lhs->codegen(CG);
+    Value *R = Rhs->codegen(CG);
+    if (!L || !R)
+        return nullptr;
+
+    IRBuilder<> &Builder = CG.getBuilder();
+    switch (Op) {
+        case '+':
+            return Builder.CreateFAdd(L, R, "addtmp");
+        case '-':
+            return Builder.CreateFSub(L, R, "subtmp");
+        case '*':
+            return Builder.CreateFMul(L, R, "multmp");
+        case '<':
+            L = Builder.CreateFCmpULT(L, R, "cmptmp");
+            // Convert bool 0/1 to double 0.0 or 1.0
+            return Builder.CreateUIToFP(L, llvm::Type::getDoubleTy(CG.getContext()), "booltmp");
+        default:
+            break;
+    }
+
+    // any other operator is a call to the function the parser named for it
+    Function *F = Callee ? CG.getFunction(*Callee) : nullptr;
+    if (!F || F->arg_size() != 2)
+        return CG.error("invalid binary operator");
+    return CG.createCall(*Callee, F, {L, R}, "binop");
+}
+
+Value* CallExprAst::codegen(CodeGen &CG) {
+    // look up the name in the module, or among earlier JIT'd functions
+    Function *CalleeF = CG.getFunction(Callee);
+    if (!CalleeF)
+        return CG.error("Unknown function referenced");
+
+    // if arg mismatch err
+    if (CalleeF->arg_size() != Args.size())
+        return CG.error("Incorrect # args passed");
+
+    std::vector<Value *> ArgsV;
+    for (auto *Arg : Args) {
+        ArgsV.push_back(Arg->codegen(CG));
+        if (!ArgsV.back())
+            return nullptr;
+    }
+    return CG.createCall(Callee, CalleeF, ArgsV, "calltmp");
+}
+
+/// isTrue - Kaleidoscope's truth test: non-zero, and not NaN
+static Value *isTrue(CodeGen &CG, Value *V, const Twine &Name) {
+    return CG.getBuilder().CreateFCmpONE(V, ConstantFP::get(CG.getContext(), APFloat(0.0)), Name);
+}
+
+/// bindVariable/restoreVariable - bring a variable into scope, and put back
+/// whatever it shadowed once the scope ends
+static AllocaInst *bindVariable(CodeGen &CG, Symbol Name, AllocaInst *A) {
+    AllocaInst *&Slot = CG.getNamedValues()[Name];
+    AllocaInst *Old = Slot;
+    Slot = A;
+    return Old;
+}
+
+static void restoreVariable(CodeGen &CG, Symbol Name, AllocaInst *Old) {
+    if (Old)
+        CG.getNamedValues()[Name] = Old;
+    else
+        CG.getNamedValues().erase(Name);
+}
+
+Value* IfExprAst::codegen(CodeGen &CG) {
+    Value *CondV = Cond->codegen(CG);
+    if (!CondV)
+        return nullptr;
+
+    IRBuilder<> &Builder = CG.getBuilder();
+    Function *F = Builder.GetInsertBlock()->getParent();
+    BasicBlock *ThenBB = BasicBlock::Create(CG.getContext(), "then", F);
+    BasicBlock *ElseBB = BasicBlock::Create(CG.getContext(), "else", F);
+    BasicBlock *MergeBB = BasicBlock::Create(CG.getContext(), "ifcont", F);
+    unsigned Counters = CG.claimCounters(2);
+    Builder.CreateCondBr(isTrue(CG, CondV, "ifcond"), ThenBB, ElseBB, CG.getBranchWeights(Counters));
+
+    // either branch can end in a different block than it started in
+    Builder.SetInsertPoint(ThenBB);
+    CG.countHere(Counters);
+    Value *ThenV = Then->codegen(CG);
+    if (!ThenV)
+        return nullptr;
+    Builder.CreateBr(MergeBB);
+    ThenBB = Builder.GetInsertBlock();
+
+    Builder.SetInsertPoint(ElseBB);
+    CG.countHere(Counters + 1);
+    Value *ElseV = Else->codegen(CG);
+    if (!ElseV)
+        return nullptr;
+    Builder.CreateBr(MergeBB);
+    ElseBB = Builder.GetInsertBlock();
+
+    Builder.SetInsertPoint(MergeBB);
+    PHINode *PN = Builder.CreatePHI(Type::getDoubleTy(CG.getContext()), 2, "iftmp");
+    PN->addIncoming(ThenV, ThenBB);
+    PN->addIncoming(ElseV, ElseBB);
+    return PN;
+}
+
+/// ForExprAst::codegen - the loop is
+///     Var = Start
+///     forcond: if !End goto forend
+///     forbody: Body; Var += Step; goto forcond
+/// with Var in scope from End on
+Value* ForExprAst::codegen(CodeGen &CG) {
+    CG.noteLoop();
+    IRBuilder<> &Builder = CG.getBuilder();
+    Function *F = Builder.GetInsertBlock()->getParent();
+    AllocaInst *Alloca = CG.createEntryBlockAlloca(F, Var);
+
+    Value *StartV = Start->codegen(CG);
+    if (!StartV)
+        return nullptr;
+    Builder.CreateStore(StartV, Alloca);
+
+    BasicBlock *CondBB = BasicBlock::Create(CG.getContext(), "forcond", F);
+    BasicBlock *LoopBB = BasicBlock::Create(CG.getContext(), "forbody", F);
+    BasicBlock *AfterBB = BasicBlock::Create(CG.getContext(), "forend", F);
+    Builder.CreateBr(CondBB);
+
+    AllocaInst *Old = bindVariable(CG, Var, Alloca);
+    auto Restore = make_scope_exit([&] { restoreVariable(CG, Var, Old); });
+
+    Builder.SetInsertPoint(CondBB);
+    Value *EndV = End->codegen(CG);
+    if (!EndV)
+        return nullptr;
+    unsigned Counters = CG.claimCounters(2);
+    Builder.CreateCondBr(isTrue(CG, EndV, "loopcond"), LoopBB, AfterBB, CG.getBranchWeights(Counters));
+
+    Builder.SetInsertPoint(LoopBB);
+    CG.countHere(Counters);
+    if (!Body->codegen(CG))
+        return nullptr;
+    Value *StepV = Step->codegen(CG);
+    if (!StepV)
+        return nullptr;
+    Value *CurVar = Builder.CreateLoad(Alloca->getAllocatedType(), Alloca, CG.getSymbols().name(Var));
+    Builder.CreateStore(Builder.CreateFAdd(CurVar, StepV, "nextvar"), Alloca);
+    Builder.CreateBr(CondBB);
+
+    Builder.SetInsertPoint(AfterBB);
+    CG.countHere(Counters + 1);
+    return Constant::getNullValue(Type::getDoubleTy(CG.getContext()));
+}
+
+Value* VarInExprAst::codegen(CodeGen &CG) {
+    IRBuilder<> &Builder = CG.getBuilder();
+    Function *F = Builder.GetInsertBlock()->getParent();
+
+    SmallVector<AllocaInst *, 4> Shadowed;
+    auto Restore = make_scope_exit([&] {
+        // newest first, so a name bound twice ends up with its outer slot
+        for (unsigned Idx = Shadowed.size(); Idx-- != 0;)
+            restoreVariable(CG, Vars[Idx].Name, Shadowed[Idx]);
+    });
+    for (const VarBinding &V : Vars) {
+        // evaluated before V is in scope, so var a = a refers to an outer a
+        Value *InitV = V.Init->codegen(CG);
+        if (!InitV)
+            return nullptr;
+        AllocaInst *Alloca = CG.createEntryBlockAlloca(F, V.Name);
+        Builder.CreateStore(InitV, Alloca);
+        Shadowed.push_back(bindVariable(CG, V.Name, Alloca));
+    }
+    return Body->codegen(CG);
+}
+
+Function* PrototypeAst::codegen(CodeGen &CG) {
+    // Make the function type: double(double, double) etc
+    SymbolTable &Symbols = CG.getSymbols();
+    std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(CG.getContext()));
+    FunctionType *Ft = FunctionType::get(Type::getDoubleTy(CG.getContext()), Doubles, false);
+    Function *F = Function::Create(Ft, Function::ExternalLinkage, Symbols.name(Name), CG.getModule());
+    unsigned Idx = 0;
+    for (auto &Arg : F->args())
+        Arg.setName(Symbols.name(Args[Idx++]));
+    return F;
+}
+
+/// emitReturn - return RetVal from F. Kaleidoscope code often loops by
+/// recursing, and the self call usually sits in an if arm whose value reaches
+/// the return through a phi. A block holding nothing but that phi is
+/// replaced by a return at the end of each arm, so a self call that is the
+/// last thing in an arm can be made musttail. That guarantees a jump instead
+/// of a call even at -O0, and TailCallElim, which runs at every level, turns
+/// it into a plain loop.
+static void emitReturn(IRBuilder<> &Builder, Value *RetVal, Function *F) {
+    BasicBlock *BB = Builder.GetInsertBlock();
+    auto *CI = dyn_cast<CallInst>(RetVal);
+    if (CI && CI->getCalledFunction() == F && &BB->back() == CI)
+        CI->setTailCallKind(CallInst::TCK_MustTail);
+
+    auto *PN = dyn_cast<PHINode>(RetVal);
+    bool Split = PN && PN->getParent() == BB && BB->size() == 1 && all_of(PN->blocks(), [&](BasicBlock *Pred) {
+        auto *Br = dyn_cast<BranchInst>(Pred->getTerminator());
+        return Br && Br->isUnconditional();
+    });
+    if (!Split) {
+        Builder.CreateRet(RetVal);
+        return;
+    }
+    for (unsigned I = 0, E = PN->getNumIncomingValues(); I != E; ++I) {
+        BasicBlock *Pred = PN->getIncomingBlock(I);
+        Pred->getTerminator()->eraseFromParent();
+        Builder.SetInsertPoint(Pred);
+        emitReturn(Builder, PN->getIncomingValue(I), F);
+    }
+    BB->eraseFromParent();
+}
+
+/// MemoEntries - slots in the table of a memo definition. A slot holds one
+/// set of arguments and its result; arguments that hash to a taken slot
+/// replace what is there.
+static constexpr uint64_t MemoEntries = 4096;
+
+/// MemoSlot - the slot of the table a memo definition's arguments hash to
+struct MemoSlot {
+    StructType *EntryTy;
+    Value *Slot;
+};
+
+/// emitMemoLookup - give F, a memo definition, a table of its own, and
+/// return from the slot its arguments hash to if they are what is in it.
+/// The builder is left where the result still has to be computed. Arguments
+/// are compared by their bits, so -0.0 is not 0.0 and a NaN is itself.
+static MemoSlot emitMemoLookup(CodeGen &CG, Function *F) {
+    LLVMContext &C = CG.getContext();
+    IRBuilder<> &Builder = CG.getBuilder();
+    Type *Int64Ty = Type::getInt64Ty(C);
+    // { in use, argument bits, result }
+    StructType *EntryTy = StructType::get(Int64Ty, ArrayType::get(Int64Ty, F->arg_size()), Type::getDoubleTy(C));
+    ArrayType *TableTy = ArrayType::get(EntryTy, MemoEntries);
+    auto *Table = new GlobalVariable(CG.getModule(), TableTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+                                     ConstantAggregateZero::get(TableTy), F->getName() + ".memo");
+
+    SmallVector<Value *, 4> Bits;
+    Value *Hash = Builder.getInt64(0);
+    for (Argument &Arg : F->args()) {
+        Bits.push_back(Builder.CreateBitCast(&Arg, Int64Ty));
+        Hash = Builder.CreateMul(Builder.CreateXor(Hash, Bits.back()), Builder.getInt64(0x9e3779b97f4a7c15));
+    }
+    Value *Idx = Builder.CreateLShr(Hash, 64 - Log2_64(MemoEntries), "memo.idx");
+    Value *Slot = Builder.CreateInBoundsGEP(TableTy, Table, {Builder.getInt64(0), Idx}, "memo.slot");
+
+    Value *Hit = Builder.CreateICmpNE(Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(EntryTy, Slot, 0)),
+                                      Builder.getInt64(0), "memo.used");
+    for (unsigned I = 0; I != Bits.size(); ++I) {
+        Value *Key = Builder.CreateInBoundsGEP(EntryTy, Slot, {Builder.getInt32(0), Builder.getInt32(1),
+                                                                 Builder.getInt32(I)});
+        Hit = Builder.CreateAnd(Hit, Builder.CreateICmpEQ(Builder.CreateLoad(Int64Ty, Key), Bits[I]), "memo.hit");
+    }
+
+    BasicBlock *HitBB = BasicBlock::Create(C, "memo.hit", F);
+    BasicBlock *MissBB = BasicBlock::Create(C, "memo.miss", F);
+    Builder.CreateCondBr(Hit, HitBB, MissBB);
+    Builder.SetInsertPoint(HitBB);
+    Builder.CreateRet(Builder.CreateLoad(Type::getDoubleTy(C), Builder.CreateStructGEP(EntryTy, Slot, 2), "memo"));
+    Builder.SetInsertPoint(MissBB);
+    return {EntryTy, Slot};
+}
+
+/// emitMemoStore - put F's arguments and Result, computed for them, in M
+static void emitMemoStore(CodeGen &CG, Function *F, MemoSlot M, Value *Result) {
+    IRBuilder<> &Builder = CG.getBuilder();
+    for (Argument &Arg : F->args()) {
+        Value *Key = Builder.CreateInBoundsGEP(M.EntryTy, M.Slot, {Builder.getInt32(0), Builder.getInt32(1),
+                                                                     Builder.getInt32(Arg.getArgNo())});
+        Builder.CreateStore(Builder.CreateBitCast(&Arg, Builder.getInt64Ty()), Key);
+    }
+    Builder.CreateStore(Result, Builder.CreateStructGEP(M.EntryTy, M.Slot, 2));
+    Builder.CreateStore(Builder.getInt64(1), Builder.CreateStructGEP(M.EntryTy, M.Slot, 0));
+}
+
+Function *FunctionAst::codegen(CodeGen &CG) {
+    RunStats &Stats = CG.getStats();
+    PhaseTimer T(Stats, Phase::Codegen);
+
+    if (CG.isDefined(Proto->getSymbol()))
+        return (Function*)CG.error("Function cannot be redefined");
+
+    // first check for an existing from a previous extern decl
+    Function *TheFunction = CG.getFunction(Proto->getSymbol());
+
+    if (!TheFunction)
+        TheFunction = Proto->codegen(CG);
+
+    if (!TheFunction)
+        return nullptr;
+
+    if (!TheFunction->empty())
+        return (Function*)CG.error("Function cannot be redefined");
+    // create a new basic block to start insertion into
+    BasicBlock *Bb = BasicBlock::Create(CG.getContext(), "entry", TheFunction);
+    CG.getBuilder().SetInsertPoint(Bb);
+
+    // counter 0 is the entry count
+    CG.beginProfile(*this, /*Count=*/true);
+    CG.beginEffects(Proto->getSymbol());
+    unsigned Entry = CG.claimCounters(1);
+    CG.countHere(Entry);
+    if (std::optional<uint64_t> Count = CG.getProfileCount(Entry))
+        TheFunction->setEntryCount(*Count);
+
+    // give every argument a slot of its own, so that it can be assigned to
+    auto &NamedValues = CG.getNamedValues();
+    NamedValues.clear();
+    for (auto [Arg, Sym] : zip(TheFunction->args(), Proto->getArgs())) {
+        AllocaInst *Alloca = CG.createEntryBlockAlloca(TheFunction, Sym);
+        CG.getBuilder().CreateStore(&Arg, Alloca);
+        NamedValues[Sym] = Alloca;
+    }
+
+    std::optional<MemoSlot> Memo;
+    if (Proto->isMemo())
+        Memo = emitMemoLookup(CG, TheFunction);
+
+    Value *RetVal = Body->codegen(CG);
+    FunctionEffects Effects = CG.getBodyEffects();
+    if (RetVal && Memo && !Effects.Pure)
+        RetVal = CG.error("memo definition calls a function that is not pure");
+    if (RetVal) {
+        // finish off the function; a memo result is stored first, so a
+        // self call is never the last thing before the return
+        if (Memo) {
+            emitMemoStore(CG, TheFunction, *Memo, RetVal);
+            Effects.NoMemory = false;
+        }
+        emitReturn(CG.getBuilder(), RetVal, TheFunction);
+        // before optimising, so that self calls are merged too
+        addEffectAttributes(*TheFunction, Effects);
+
+        Stats.IRInstructions += TheFunction->getInstructionCount();
+
+        // validate the generated code, checking for consistency
+        {
+            PhaseTimer VT(Stats, Phase::Verify);
+            verifyFunction(*TheFunction);
+        }
+
+        // clean up the naive IR at the selected -O level
+        CG.optimize(*TheFunction);
+
+        ++Stats.Functions;
+        CG.recordPrototype(*Proto);
+        CG.setEffects(Proto->getSymbol(), Effects);
+        if (CG.getOptions().MapWrappers && Proto->getSymbol() != SymAnon)
+            codegenMap(CG);
+        return TheFunction;
+    }
+    // error reading body, remove func
+    TheFunction->eraseFromParent();
+    return nullptr;
+}
+
+/// codegenMap - emits
+///     void name_map(const double *const *Cols, double *Out, uint64_t N)
+/// which sets Out[I] = name(Cols[0][I], ..., Cols[n-1][I]) for every I < N.
+/// Calling the scalar function from the loop would leave a call the
+/// vectoriser cannot see through, so the body is lowered a second time in
+/// its place. Calls the body makes itself stay calls.
+Function *FunctionAst::codegenMap(CodeGen &CG) {
+    LLVMContext &Ctx = CG.getContext();
+    IRBuilder<> &Builder = CG.getBuilder();
+    SymbolTable &Symbols = CG.getSymbols();
+    Type *DoubleTy = Type::getDoubleTy(Ctx);
+    Type *ColTy = PointerType::getUnqual(DoubleTy);
+    Type *CountTy = Type::getInt64Ty(Ctx);
+    FunctionType *Ft = FunctionType::get(Type::getVoidTy(Ctx), {PointerType::getUnqual(ColTy), ColTy, CountTy}, false);
+    Function *F = Function::Create(Ft, Function::ExternalLinkage, getMapName(Symbols.name(Proto->getSymbol())),
+                                   CG.getModule());
+    Argument *Cols = F->getArg(0), *Out = F->getArg(1), *N = F->getArg(2);
+    Cols->setName("cols");
+    Out->setName("out");
+    N->setName("n");
+
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", F);
+    BasicBlock *Loop = BasicBlock::Create(Ctx, "loop", F);
+    BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", F);
+
+    // the column pointers do not change, so load them once up front
+    Builder.SetInsertPoint(Entry);
+    SmallVector<Value *, 4> ColPtrs;
+    for (unsigned Idx = 0; Idx != Proto->getArgs().size(); ++Idx)
+        ColPtrs.push_back(Builder.CreateLoad(ColTy, Builder.CreateConstInBoundsGEP1_64(ColTy, Cols, Idx), "col"));
+    Builder.CreateCondBr(Builder.CreateICmpEQ(N, ConstantInt::get(CountTy, 0)), Exit, Loop);
+
+    Builder.SetInsertPoint(Loop);
+    PHINode *I = Builder.CreatePHI(CountTy, 2, "i");
+    I->addIncoming(ConstantInt::get(CountTy, 0), Entry);
+    // branches get the scalar function's weights
+    CG.beginProfile(*this, /*Count=*/false);
+    CG.claimCounters(1);
+    auto &NamedValues = CG.getNamedValues();
+    NamedValues.clear();
+    for (auto [Col, Sym] : zip(ColPtrs, Proto->getArgs())) {
+        AllocaInst *Alloca = CG.createEntryBlockAlloca(F, Sym);
+        Builder.CreateStore(Builder.CreateLoad(DoubleTy, Builder.CreateInBoundsGEP(DoubleTy, Col, I)), Alloca);
+        NamedValues[Sym] = Alloca;
+    }
+
+    Value *RetVal = Body->codegen(CG);
+    if (!RetVal) {
+        F->eraseFromParent();
+        return nullptr;
+    }
+    Builder.CreateStore(RetVal, Builder.CreateInBoundsGEP(DoubleTy, Out, I));
+    Value *Next = Builder.CreateNUWAdd(I, ConstantInt::get(CountTy, 1), "next");
+    I->addIncoming(Next, Builder.GetInsertBlock());
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Next, N), Exit, Loop);
+
+    Builder.SetInsertPoint(Exit);
+    Builder.CreateRetVoid();
+
+    CG.getStats().IRInstructions += F->getInstructionCount();
+    {
+        PhaseTimer VT(CG.getStats(), Phase::Verify);
+        verifyFunction(*F);
+    }
+    CG.optimizeMap(*F);
+    return F;
+}
+
+void CodeGen::initializeModule() {
+    // Drop anything still tied to the old context before replacing it.
+    ModuleFunctions.clear();
+    TheFPM.reset();
+    TheMapFPM.reset();
+    TheLAM.reset();
+    TheFAM.reset();
+    TheCGAM.reset();
+    TheMAM.reset();
+    Builder.reset();
+    TheModule.reset();
+
+    // Open a new context and module.
+    TheContext = std::make_unique<LLVMContext>();
+    TheModule = std::make_unique<Module>(Opts.ModuleName, *TheContext);
+    if (TM) {
+        TheModule->setTargetTriple(TM->getTargetTriple().str());
+        TheModule->setDataLayout(TM->createDataLayout());
+    } else if (DL) {
+        TheModule->setDataLayout(*DL);
+    }
+    if (Prof) {
+        if (Metadata *Summary = Prof->getSummary(*TheContext))
+            TheModule->setProfileSummary(Summary, ProfileSummary::PSK_Instr);
+    }
+
+    // Create a new builder for the module. With -fast-math every operation
+    // it creates may be reassociated and fused, which is what lets chains of
+    // + and * turn into FMAs and vector reductions.
+    Builder = std::make_unique<IRBuilder<>>(*TheContext);
+    if (Opts.FastMath) {
+        FastMathFlags FMF;
+        FMF.setAllowReassoc();
+        FMF.setAllowContract(true);
+        FMF.setNoSignedZeros();
+        Builder->setFastMathFlags(FMF);
+    }
+
+    // Create new pass and analysis managers.
+    TheFPM = std::make_unique<FunctionPassManager>();
+    TheMapFPM = std::make_unique<FunctionPassManager>();
+    TheLAM = std::make_unique<LoopAnalysisManager>();
+    TheFAM = std::make_unique<FunctionAnalysisManager>();
+    TheCGAM = std::make_unique<CGSCCAnalysisManager>();
+    TheMAM = std::make_unique<ModuleAnalysisManager>();
+    ThePIC = std::make_unique<PassInstrumentationCallbacks>();
+
+    // Register analysis passes used in these transform passes.
+    PassBuilder PB(TM, PipelineTuningOptions(), std::nullopt, ThePIC.get());
+    Stats.registerPassTimers(*ThePIC);
+    PB.registerModuleAnalyses(*TheMAM);
+    PB.registerCGSCCAnalyses(*TheCGAM);
+    PB.registerFunctionAnalyses(*TheFAM);
+    PB.registerLoopAnalyses(*TheLAM);
+    PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+
+    // -O0 only promotes locals and removes tail recursion; otherwise use LLVM's per-function
+    // simplification pipeline (InstCombine, Reassociate, GVN, SimplifyCFG...),
+    // which has TailCallElim from -O2 up. Batch mode optimises the finished
+    // module as a whole instead. Map wrappers also get the loop vectoriser,
+    // which the module pipeline runs for batch mode.
+    if (Opts.Batch)
+        return;
+    if (Opts.OptLevel == OptimizationLevel::O0) {
+        TheFPM->addPass(PromotePass());
+        TheFPM->addPass(TailCallElimPass());
+        TheMapFPM->addPass(PromotePass());
+        return;
+    }
+    *TheFPM = PB.buildFunctionSimplificationPipeline(Opts.OptLevel, ThinOrFullLTOPhase::None);
+    if (Opts.OptLevel == OptimizationLevel::O1)
+        TheFPM->addPass(TailCallElimPass());
+    *TheMapFPM = PB.buildFunctionSimplificationPipeline(Opts.OptLevel, ThinOrFullLTOPhase::None);
+    TheMapFPM->addPass(LoopVectorizePass());
+    TheMapFPM->addPass(InstCombinePass());
+    TheMapFPM->addPass(SimplifyCFGPass());
+}
+
+orc::ThreadSafeModule CodeGen::takeModule() {
+    orc::ThreadSafeModule TSM(std::move(TheModule), std::move(TheContext));
+    initializeModule();
+    return TSM;
+}
+
+//===----------------------------------------------------------------------===//
+// Object file emission
+//===----------------------------------------------------------------------===//
+
+std::string getNativeFeatures() {
+    StringMap<bool> HostFeatures;
+    std::string Features;
+    if (!sys::getHostCPUFeatures(HostFeatures))
+        return Features;
+    for (auto &F : HostFeatures) {
+        if (!Features.empty())
+            Features += ',';
+        Features += (F.getValue() ? "+" : "-") + F.getKey().str();
+    }
+    return Features;
+}
+
+Expected<std::unique_ptr<TargetMachine>> createHostTargetMachine(const CodegenOptions &Opts) {
+    std::string TargetTriple = sys::getDefaultTargetTriple();
+    std::string Error;
+    const Target *TheTarget = TargetRegistry::lookupTarget(TargetTriple, Error);
+    if (!TheTarget)
+        return createStringError(inconvertibleErrorCode(), Error);
+
+    std::string CPU = Opts.CPU.empty() ? "generic" : Opts.CPU;
+    std::string Features;
+    if (CPU == "native") {
+        CPU = sys::getHostCPUName().str();
+        Features = getNativeFeatures();
+    }
+
+    TargetOptions Opt;
+    if (Opts.FastMath)
+        Opt.AllowFPOpFusion = FPOpFusion::Fast;
+    std::unique_ptr<TargetMachine> TM(TheTarget->createTargetMachine(TargetTriple, CPU, Features, Opt, Reloc::PIC_));
+    if (llvm::Error E = checkTargetCPU(*TM))
+        return E;
+    return TM;
+}
+
+Error checkTargetCPU(const TargetMachine &TM) {
+    if (TM.getMCSubtargetInfo()->isCPUStringValid(TM.getTargetCPU()))
+        return Error::success();
+    return createStringError(inconvertibleErrorCode(), "unknown CPU '%s' for %s", TM.getTargetCPU().str().c_str(),
+                             TM.getTargetTriple().str().c_str());
+}
+
+bool CodeGen::optimizeModule() {
+    if (verifyModule(*TheModule, &errs())) {
+        Diags.error("generated module is broken");
+        return false;
+    }
+
+    OptimizationLevel Level = Opts.OptLevel;
+    PassBuilder PB(TM, PipelineTuningOptions(), std::nullopt, ThePIC.get());
+    // the -O0 and -O1 pipelines have no TailCallElim, so tail recursion is
+    // removed up front, and -O0 promotes locals as the JIT does
+    ModulePassManager MPM;
+    if (Level == OptimizationLevel::O0)
+        MPM.addPass(createModuleToFunctionPassAdaptor(PromotePass()));
+    if (Level == OptimizationLevel::O0 || Level == OptimizationLevel::O1)
+        MPM.addPass(createModuleToFunctionPassAdaptor(TailCallElimPass()));
+    MPM.addPass(Level == OptimizationLevel::O0 ? PB.buildO0DefaultPipeline(Level)
+                                               : PB.buildPerModuleDefaultPipeline(Level));
+    {
+        PhaseTimer T(Stats, Phase::Optimize);
+        MPM.run(*TheModule, *TheMAM);
+    }
+    Stats.OptimizedInstructions += TheModule->getInstructionCount();
+    return true;
+}
+
+void runModulePipeline(Module &M, OptimizationLevel Level, TargetMachine &TM) {
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(&TM);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(Level);
+    MPM.run(M, MAM);
+}
+
+//===----------------------------------------------------------------------===//
+// Tiered compilation
+//===----------------------------------------------------------------------===//
+
+void addTierUpCheck(Function &F, uint64_t *Counter, uint64_t Threshold, TierUpNotify Notify, void *Ctx,
+                    uint64_t Arg) {
+    LLVMContext &C = F.getContext();
+    Type *Int64Ty = Type::getInt64Ty(C);
+    Type *IntPtrTy = F.getParent()->getDataLayout().getIntPtrType(C);
+    auto *PtrTy = PointerType::getUnqual(Int64Ty);
+    // everything named here lives in the host, so it is all constants
+    auto HostPtr = [&](const void *P, Type *Ty) {
+        return ConstantExpr::getIntToPtr(ConstantInt::get(IntPtrTy, reinterpret_cast<uintptr_t>(P)), Ty);
+    };
+
+    IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
+    Constant *Addr = HostPtr(Counter, PtrTy);
+    Value *Calls = Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Addr, "calls"), ConstantInt::get(Int64Ty, 1));
+    Builder.CreateStore(Calls, Addr);
+    Value *Hot = Builder.CreateICmpEQ(Calls, ConstantInt::get(Int64Ty, Threshold), "hot");
+
+    // taken once, so keep it out of the way
+    MDNode *Weights = MDBuilder(C).createBranchWeights(1, std::clamp<uint64_t>(Threshold, 2, UINT32_MAX) - 1);
+    Instruction *Then = SplitBlockAndInsertIfThen(Hot, cast<Instruction>(Hot)->getNextNode(), false, Weights);
+    Builder.SetInsertPoint(Then);
+    auto *NotifyTy = FunctionType::get(Type::getVoidTy(C), {PtrTy, Int64Ty}, false);
+    Builder.CreateCall(NotifyTy, HostPtr(reinterpret_cast<const void *>(Notify), PointerType::getUnqual(NotifyTy)),
+                       {HostPtr(Ctx, PtrTy), ConstantInt::get(Int64Ty, Arg)});
+}
+
+bool CodeGen::emitObjectFile(StringRef Filename) {
+    std::error_code EC;
+    raw_fd_ostream Dest(Filename, EC, sys::fs::OF_None);
+    if (EC) {
+        Diags.error("could not open '" + Filename + "': " + EC.message());
+        return false;
+    }
+
+    legacy::PassManager CodeGenPasses;
+    if (TM->addPassesToEmitFile(CodeGenPasses, Dest, nullptr, CGFT_ObjectFile)) {
+        Diags.error("the target cannot emit an object file");
+        return false;
+    }
+    PhaseTimer T(Stats, Phase::Emit);
+    CodeGenPasses.run(*TheModule);
+    Dest.flush();
+    return true;
+}
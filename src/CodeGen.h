@@ -0,0 +1,289 @@
+//
+// CodeGen.h - LLVM IR generation and optimisation
+//
+
+#ifndef KALEIDO_CODEGEN_H
+#define KALEIDO_CODEGEN_H
+
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "AST.h"
+#include "Diagnostics.h"
+#include "Lexer.h"
+#include "Profile.h"
+#include "Stats.h"
+
+namespace llvm {
+class PassInstrumentationCallbacks;
+}
+
+/// CodegenOptions - knobs fixed when a session is created
+struct CodegenOptions {
+    llvm::OptimizationLevel OptLevel = llvm::OptimizationLevel::O2;
+    /// build one module for the whole input (-c) instead of one per item
+    bool Batch = false;
+    std::string ModuleName = "my cool jit";
+    /// also emit <name>_map for every definition (see kaleido.h)
+    bool MapWrappers = true;
+    /// let + and * be reassociated and contracted into FMAs
+    bool FastMath = false;
+    /// CPU to generate code for, "native" for the host with all its
+    /// features, or empty for the default: the host for the JIT, generic
+    /// for -c so that objects run anywhere
+    std::string CPU;
+    /// mark definitions that touch no memory readnone, so that calls to them
+    /// can be merged; off when the session adds code to them that does
+    bool MarkReadNone = true;
+};
+
+/// FunctionEffects - what a call to a function can do, as far as is known.
+/// Each flag implies the one before it.
+struct FunctionEffects {
+    /// Pure - equal arguments give equal results, and nothing else about the
+    /// call can be seen; it cannot unwind
+    bool Pure = false;
+    /// NoMemory - it reads and writes no memory at all, which a memo table
+    /// or a profile counter would (readnone)
+    bool NoMemory = false;
+    /// Returns - it always returns: it has no loops, no recursion, and calls
+    /// only functions that return (willreturn)
+    bool Returns = false;
+};
+
+/// getMapName - symbol of the map wrapper of the definition called Name.
+/// Identifiers are alphanumeric, so it cannot clash with a definition.
+inline std::string getMapName(llvm::StringRef Name) { return (Name + "_map").str(); }
+
+/// CodeGen - lowers the AST into the current module. In JIT mode the driver
+/// takes each finished module away with takeModule; in batch mode everything
+/// goes into one module that optimizeModule and emitObjectFile finish off.
+class CodeGen {
+    CodegenOptions Opts;
+    SymbolTable &Symbols;
+    Diagnostics &Diags;
+    RunStats &Stats;
+
+    /// TM - the host modules are optimised for, which also emits them with -c
+    llvm::TargetMachine *TM = nullptr;
+    std::optional<llvm::DataLayout> DL;
+
+    std::unique_ptr<llvm::LLVMContext> TheContext;
+    std::unique_ptr<llvm::Module> TheModule;
+    std::unique_ptr<llvm::IRBuilder<>> Builder;
+    /// NamedValues - the stack slot of every variable in scope: arguments
+    /// and locals alike live in entry-block allocas, which mem2reg and SROA
+    /// turn back into registers
+    llvm::DenseMap<Symbol, llvm::AllocaInst *> NamedValues;
+    /// ModuleFunctions - callees already resolved in the current module, so
+    /// that call sites do not look them up by name. A handle goes null when
+    /// its function is erased.
+    llvm::DenseMap<Symbol, llvm::WeakVH> ModuleFunctions;
+
+    /// per-module optimisation state, rebuilt alongside each new module
+    std::unique_ptr<llvm::FunctionPassManager> TheFPM;
+    /// TheMapFPM - TheFPM plus loop vectorisation, for map wrappers
+    std::unique_ptr<llvm::FunctionPassManager> TheMapFPM;
+    std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+    std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+    std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+    std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+    std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
+
+    /// ProtoArena - backs the argument lists of FunctionProtos, which outlive
+    /// the per-item AST arena
+    llvm::BumpPtrAllocator ProtoArena;
+    /// FunctionProtos - latest prototype of every function, so each new module
+    /// can re-declare functions that were compiled into earlier ones
+    llvm::DenseMap<Symbol, PrototypeAst> FunctionProtos;
+    /// DefinedFunctions - functions whose bodies are in the JIT right now
+    llvm::DenseSet<Symbol> DefinedFunctions;
+    /// BoundAddresses - where the JIT has put functions that are already in
+    /// memory; calls to them go straight to the address
+    llvm::DenseMap<Symbol, uint64_t> BoundAddresses;
+    /// Effects - what calling each function does: declared with extern pure,
+    /// read from bitcode, or inferred from the body when it was generated
+    llvm::DenseMap<Symbol, FunctionEffects> Effects;
+    /// BodyEffects - inferred so far for EffectsOf, the definition being
+    /// generated, from what its body does
+    Symbol EffectsOf = SymAnon;
+    FunctionEffects BodyEffects;
+
+    /// Prof - counters to instrument definitions with and counts to annotate
+    /// them with; null unless profiling
+    Profile *Prof = nullptr;
+    bool Instrument = false;
+    /// profile state of the definition being generated, set by beginProfile
+    bool Profiling = false;
+    bool Counting = false;
+    llvm::StringRef ProfileName;
+    uint64_t ProfileHash = 0;
+    llvm::ArrayRef<uint64_t> ProfileCounts;
+    unsigned NextCounter = 0;
+public:
+    CodeGen(const CodegenOptions &Opts, SymbolTable &Symbols, Diagnostics &Diags, RunStats &Stats);
+    ~CodeGen();
+    CodeGen(const CodeGen &) = delete;
+    CodeGen &operator=(const CodeGen &) = delete;
+
+    /// setTargetMachine - generate modules for TM, which must outlive us
+    void setTargetMachine(llvm::TargetMachine *T) { TM = T; }
+    /// setProfile - annotate definitions with the counts P has loaded and,
+    /// with Instr, add counters for P to collect. P must outlive us.
+    void setProfile(Profile *P, bool Instr) {
+        Prof = P;
+        Instrument = Instr;
+    }
+    /// setDataLayout - data layout for modules when there is no TargetMachine
+    void setDataLayout(const llvm::DataLayout &Layout) { DL = Layout; }
+
+    [[nodiscard]] const CodegenOptions &getOptions() const { return Opts; }
+    [[nodiscard]] SymbolTable &getSymbols() { return Symbols; }
+    [[nodiscard]] RunStats &getStats() { return Stats; }
+    [[nodiscard]] llvm::LLVMContext &getContext() { return *TheContext; }
+    [[nodiscard]] llvm::Module &getModule() { return *TheModule; }
+    [[nodiscard]] llvm::IRBuilder<> &getBuilder() { return *Builder; }
+    [[nodiscard]] llvm::DenseMap<Symbol, llvm::AllocaInst *> &getNamedValues() { return NamedValues; }
+
+    /// createEntryBlockAlloca - a double slot for the variable Name at the
+    /// top of F's entry block, where mem2reg can promote it
+    llvm::AllocaInst *createEntryBlockAlloca(llvm::Function *F, Symbol Name);
+
+    /// error - report Str and return the null Value codegen fails with
+    llvm::Value *error(const char *Str);
+
+    /// getFunction - find Name in the current module, declaring it from its
+    /// recorded prototype if it was defined in an earlier one
+    llvm::Function *getFunction(Symbol Name);
+    /// getCallee - what a call to F, the function called Name, should call:
+    /// its bound address if it has one, F itself otherwise
+    llvm::FunctionCallee getCallee(Symbol Name, llvm::Function *F);
+    /// createCall - call F, the function called Name, through getCallee. The
+    /// call gets the attributes Name's effects allow, and counts towards the
+    /// effects of the body being generated.
+    llvm::CallInst *createCall(Symbol Name, llvm::Function *F, llvm::ArrayRef<llvm::Value *> Args,
+                               const llvm::Twine &ValName);
+
+    /// recordPrototype - remember P past the lifetime of the AST it came from
+    void recordPrototype(const PrototypeAst &P);
+    /// getPrototype - the latest prototype recorded for Name, or null
+    [[nodiscard]] const PrototypeAst *getPrototype(Symbol Name) const {
+        auto It = FunctionProtos.find(Name);
+        return It == FunctionProtos.end() ? nullptr : &It->second;
+    }
+    /// getPrototypes - every prototype recorded, by name
+    [[nodiscard]] const llvm::DenseMap<Symbol, PrototypeAst> &getPrototypes() const { return FunctionProtos; }
+
+    [[nodiscard]] bool isDefined(Symbol Name) const { return DefinedFunctions.contains(Name); }
+    void markDefined(Symbol Name) { DefinedFunctions.insert(Name); }
+    void markUndefined(Symbol Name) {
+        DefinedFunctions.erase(Name);
+        BoundAddresses.erase(Name);
+        Effects.erase(Name);
+    }
+
+    /// bindAddress - Name is in memory at Addr for good, or until it is
+    /// marked undefined
+    void bindAddress(Symbol Name, uint64_t Addr) { BoundAddresses[Name] = Addr; }
+    [[nodiscard]] bool isBound(Symbol Name) const { return BoundAddresses.count(Name) != 0; }
+    /// getBoundAddress - where Name was bound, or 0
+    [[nodiscard]] uint64_t getBoundAddress(Symbol Name) const { return BoundAddresses.lookup(Name); }
+
+    /// getEffects/setEffects - what is known about calling Name. Recording a
+    /// prototype resets them to what it declares.
+    [[nodiscard]] FunctionEffects getEffects(Symbol Name) const { return Effects.lookup(Name); }
+    void setEffects(Symbol Name, FunctionEffects E) { Effects[Name] = E; }
+    /// beginEffects - start inferring the effects of the definition Name
+    void beginEffects(Symbol Name);
+    /// noteLoop - the body has a loop, which might not end
+    void noteLoop() { BodyEffects.Returns = false; }
+    /// getBodyEffects - the effects of the body generated since beginEffects
+    [[nodiscard]] FunctionEffects getBodyEffects() const { return BodyEffects; }
+    /// predictEffects - the effects generating Fn would infer, worked out
+    /// from its AST and what is known about its callees, for batch workers
+    /// that need them before the body is generated. Batch mode never
+    /// instruments, so that is not taken into account.
+    [[nodiscard]] FunctionEffects predictEffects(const FunctionAst &Fn) const;
+
+    /// beginProfile - number the counters of Fn's body from the start. Count
+    /// is false for the map wrapper, which reuses the counts of the scalar
+    /// function without adding to them.
+    void beginProfile(const FunctionAst &Fn, bool Count);
+    /// claimCounters - index of the first of N new counters of the current
+    /// definition
+    unsigned claimCounters(unsigned N) {
+        unsigned Idx = NextCounter;
+        NextCounter += N;
+        return Idx;
+    }
+    /// countHere - increment counter Idx at the insertion point, if
+    /// instrumenting
+    void countHere(unsigned Idx);
+    /// getProfileCount - what counter Idx counted in the loaded profile
+    [[nodiscard]] std::optional<uint64_t> getProfileCount(unsigned Idx) const;
+    /// getBranchWeights - !prof weights for a branch whose sides counters Idx
+    /// and Idx + 1 counted, or null without counts
+    llvm::MDNode *getBranchWeights(unsigned Idx);
+
+    /// optimize - run the per-function pipeline over F (nothing in batch mode)
+    void optimize(llvm::Function &F);
+    /// optimizeMap - the same for a map wrapper, which is also vectorised
+    void optimizeMap(llvm::Function &F);
+
+    /// initializeModule - start a fresh context, module, builder and pass pipeline
+    void initializeModule();
+
+    /// takeModule - hand the current module over and start a fresh one
+    llvm::orc::ThreadSafeModule takeModule();
+
+    /// optimizeModule - verify the finished module and run the whole-module
+    /// pipeline at the selected -O level
+    bool optimizeModule();
+
+    /// emitObjectFile - write the module to Filename as native code
+    bool emitObjectFile(llvm::StringRef Filename);
+};
+
+/// createHostTargetMachine - set up code generation for the host triple, with
+/// the CPU and floating point options of Opts
+llvm::Expected<std::unique_ptr<llvm::TargetMachine>> createHostTargetMachine(const CodegenOptions &Opts);
+
+/// checkTargetCPU - LLVM only warns about a CPU it does not know, and then
+/// aborts on the first function it compiles, so make that an error up front
+llvm::Error checkTargetCPU(const llvm::TargetMachine &TM);
+
+/// getNativeFeatures - the host CPU's features, as a target feature string
+std::string getNativeFeatures();
+
+/// TierUpNotify - what addTierUpCheck calls once a function is hot
+using TierUpNotify = void (*)(void *Ctx, uint64_t Arg);
+
+/// addTierUpCheck - make F count its calls in Counter, and call
+/// Notify(Ctx, Arg) on the Threshold-th of them
+void addTierUpCheck(llvm::Function &F, uint64_t *Counter, uint64_t Threshold, TierUpNotify Notify, void *Ctx,
+                    uint64_t Arg);
+
+/// runModulePipeline - optimise M, a module on its own, with the -O Level
+/// module pipeline for TM
+void runModulePipeline(llvm::Module &M, llvm::OptimizationLevel Level, llvm::TargetMachine &TM);
+
+#endif // KALEIDO_CODEGEN_H
@@ -0,0 +1,1476 @@
+//
+// CompilerSession.cpp - REPL, batch compilation and JIT driver
+//
+
+#include "CompilerSession.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/PointerUnion.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SHA256.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Interpreter.h"
+
+using namespace llvm;
+
+/// baselineOptions - what the session's own CodeGen builds with; in tiered
+/// mode that is tier 0
+static CodegenOptions baselineOptions(const SessionOptions &Opts) {
+    CodegenOptions Baseline = Opts.CodeGen;
+    if (Opts.Tiered) {
+        Baseline.OptLevel = OptimizationLevel::O0;
+        // tier 0 counts its calls
+        Baseline.MarkReadNone = false;
+    }
+    return Baseline;
+}
+
+CompilerSession::CompilerSession(const SessionOptions &Opts)
+        : Diags(Opts.ErrorLimit), Lex(Symbols, Stats), Ast(Stats), P(Lex, Ast, Diags),
+          CG(baselineOptions(Opts), Symbols, Diags, Stats),
+          Jobs(Opts.Jobs), Quiet(Opts.Quiet), PrintResults(Opts.PrintResults),
+          Interpret(Opts.Interpret && !Opts.CodeGen.FastMath), SavedAst(Stats) {
+    if (Opts.Timing)
+        Stats.enable(Opts.TimePasses);
+}
+
+/// lazyCallFailed - where a call lands when its definition could not be
+/// compiled; the error itself has been reported already. The call-through
+/// jumps here in place of the definition, so this returns to its caller,
+/// and the call yields NaN.
+static double lazyCallFailed() {
+    fprintf(stderr, "kaleido: called a definition that failed to compile\n");
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+/// the module flag that marks a tier-1 module
+static constexpr StringLiteral TierFlag = "kaleido.tier";
+
+/// TieredCompiler - compiles tier-0 modules with FastISel and no machine
+/// optimisation, and tier-1 ones with everything. It builds a TargetMachine
+/// per module, so tiers can be compiled on different threads.
+class TieredCompiler : public orc::IRCompileLayer::IRCompiler {
+    orc::JITTargetMachineBuilder JTMB;
+public:
+    explicit TieredCompiler(orc::JITTargetMachineBuilder JTMB)
+            : IRCompiler(orc::irManglingOptionsFromTargetOptions(JTMB.getOptions())), JTMB(std::move(JTMB)) {}
+
+    Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+        orc::JITTargetMachineBuilder Builder = JTMB;
+        Builder.setCodeGenOptLevel(M.getModuleFlag(TierFlag) ? CodeGenOpt::Aggressive : CodeGenOpt::None);
+        auto TM = Builder.createTargetMachine();
+        if (!TM)
+            return TM.takeError();
+        return orc::SimpleCompiler(**TM)(M);
+    }
+};
+
+Expected<std::unique_ptr<CompilerSession>> CompilerSession::create(const SessionOptions &Opts,
+                                                                   const CompilerSession *Library) {
+    // target registration is process-wide
+    static std::once_flag TargetsInitialized;
+    std::call_once(TargetsInitialized, [] {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+    });
+
+    // a shared JIT compiles on every session's thread, and its sessions
+    // must not write files or counters, or build stubs, of their own
+    if ((Opts.ShareJIT || Library) &&
+        (Opts.CodeGen.Batch || Opts.Lazy || Opts.Tiered || !Opts.CacheDir.empty() || !Opts.EmitLLVM.empty() ||
+         !Opts.EmitBC.empty() || !Opts.ProfileGenerate.empty()))
+        return createStringError(inconvertibleErrorCode(),
+                                 "sessions sharing a JIT cannot use -c, -lazy, -tiered, the object cache, "
+                                 "--emit-llvm, --emit-bc or --profile-generate");
+    if (Library && !Library->Shared)
+        return createStringError(inconvertibleErrorCode(), "the library session does not share its JIT");
+
+    std::unique_ptr<CompilerSession> S(new CompilerSession(Opts));
+    if (!Opts.EmitLLVM.empty()) {
+        std::error_code EC;
+        S->IROut = std::make_unique<raw_fd_ostream>(Opts.EmitLLVM, EC, sys::fs::OF_Text);
+        if (EC)
+            return createStringError(EC, "could not open '%s': %s", Opts.EmitLLVM.c_str(), EC.message().c_str());
+    }
+    if (!Opts.EmitBC.empty()) {
+        // lazy bodies that are never called have no IR to write
+        if (Opts.Lazy)
+            return createStringError(inconvertibleErrorCode(), "--emit-bc cannot be used with -lazy");
+        // counters are addresses in this process
+        if (!Opts.ProfileGenerate.empty())
+            return createStringError(inconvertibleErrorCode(), "--emit-bc cannot be used with --profile-generate");
+        std::error_code EC;
+        S->BCOut = std::make_unique<raw_fd_ostream>(Opts.EmitBC, EC, sys::fs::OF_None);
+        if (EC)
+            return createStringError(EC, "could not open '%s': %s", Opts.EmitBC.c_str(), EC.message().c_str());
+    }
+    if (!Opts.ProfileGenerate.empty() || !Opts.ProfileUse.empty()) {
+        // the counters are in this process, so only the JIT can run them
+        if (!Opts.ProfileGenerate.empty() && Opts.CodeGen.Batch)
+            return createStringError(inconvertibleErrorCode(), "--profile-generate cannot be used with -c");
+        S->Prof = std::make_unique<Profile>();
+        if (!Opts.ProfileUse.empty()) {
+            if (Error E = S->Prof->load(Opts.ProfileUse))
+                return E;
+        }
+        S->ProfileOut = Opts.ProfileGenerate;
+        S->CG.setProfile(S->Prof.get(), !Opts.ProfileGenerate.empty());
+    }
+    if (Opts.Tiered && (Opts.Lazy || Opts.CodeGen.Batch))
+        return createStringError(inconvertibleErrorCode(), "-tiered cannot be used with -lazy or -c");
+    if (Opts.Tiered && Opts.TierUpThreshold == 0)
+        return createStringError(inconvertibleErrorCode(), "-tier-up-threshold must be at least 1");
+    // cached objects know nothing of profiles or tiers, and instrumented
+    // ones point into this process
+    if (!Opts.CacheDir.empty() && !S->Prof && !Opts.Tiered)
+        S->ObjCache = std::make_unique<DiskObjectCache>(Opts.CacheDir);
+
+    if (Opts.CodeGen.Batch) {
+        auto TM = createHostTargetMachine(Opts.CodeGen);
+        if (!TM)
+            return TM.takeError();
+        S->TM = std::move(*TM);
+        S->CG.setTargetMachine(S->TM.get());
+    } else {
+        // the JIT and our own pipelines target the same host, so that the
+        // vectoriser knows which vector units it can use
+        auto JTMB = orc::JITTargetMachineBuilder::detectHost();
+        if (!JTMB)
+            return JTMB.takeError();
+        const std::string &CPU = Opts.CodeGen.CPU;
+        if (!CPU.empty() && CPU != "native") {
+            JTMB->setCPU(CPU);
+            JTMB->getFeatures() = SubtargetFeatures();
+        }
+        if (Opts.CodeGen.FastMath)
+            JTMB->getOptions().AllowFPOpFusion = FPOpFusion::Fast;
+        auto TM = JTMB->createTargetMachine();
+        if (!TM)
+            return TM.takeError();
+        if (Error E = checkTargetCPU(**TM))
+            return E;
+        S->TM = std::move(*TM);
+        S->CG.setTargetMachine(S->TM.get());
+
+        if (Library) {
+            if (Error E = S->attachLibrary(*Library))
+                return E;
+            S->CG.initializeModule();
+            return S;
+        }
+
+        orc::JITTargetMachineBuilder TierJTMB = *JTMB;
+        orc::LLJITBuilder Builder;
+        Builder.setJITTargetMachineBuilder(std::move(*JTMB));
+        if (Opts.Tiered) {
+            Builder.setCompileFunctionCreator([](orc::JITTargetMachineBuilder JTMB)
+                                                      -> Expected<std::unique_ptr<orc::IRCompileLayer::IRCompiler>> {
+                return std::make_unique<TieredCompiler>(std::move(JTMB));
+            });
+        } else if (DiskObjectCache *Cache = S->ObjCache.get()) {
+            Builder.setCompileFunctionCreator([Cache](orc::JITTargetMachineBuilder JTMB)
+                                                      -> Expected<std::unique_ptr<orc::IRCompileLayer::IRCompiler>> {
+                auto TM = JTMB.createTargetMachine();
+                if (!TM)
+                    return TM.takeError();
+                return std::make_unique<orc::TMOwningSimpleCompiler>(std::move(*TM), Cache);
+            });
+        } else if (Opts.ShareJIT) {
+            // one TargetMachine per module, since sessions compile at once
+            Builder.setCompileFunctionCreator([](orc::JITTargetMachineBuilder JTMB)
+                                                      -> Expected<std::unique_ptr<orc::IRCompileLayer::IRCompiler>> {
+                return std::make_unique<orc::ConcurrentIRCompiler>(std::move(JTMB));
+            });
+        }
+        auto JIT = Builder.create();
+        if (!JIT)
+            return JIT.takeError();
+        S->OwnedJIT = std::move(*JIT);
+        S->JIT = S->OwnedJIT.get();
+        S->MainJD = &S->JIT->getMainJITDylib();
+        S->Shared = Opts.ShareJIT;
+        // let externs resolve against the host process (libm and friends)
+        auto Gen = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+                S->JIT->getDataLayout().getGlobalPrefix());
+        if (!Gen)
+            return Gen.takeError();
+        S->MainJD->addGenerator(std::move(*Gen));
+        // modules loaded from bitcode keep their bodies in the file until
+        // they are compiled
+        S->JIT->getIRTransformLayer().setTransform(
+                [](orc::ThreadSafeModule TSM,
+                   orc::MaterializationResponsibility &) -> Expected<orc::ThreadSafeModule> {
+                    if (Error E = TSM.withModuleDo([](Module &M) { return M.materializeAll(); }))
+                        return E;
+                    return TSM;
+                });
+
+        if (Opts.Lazy) {
+            orc::ExecutionSession &ES = S->JIT->getExecutionSession();
+            const Triple &TT = S->JIT->getTargetTriple();
+            auto LCTM = orc::createLocalLazyCallThroughManager(TT, ES, orc::ExecutorAddr::fromPtr(&lazyCallFailed));
+            if (!LCTM)
+                return LCTM.takeError();
+            S->LCTM = std::move(*LCTM);
+            S->ISM = orc::createLocalIndirectStubsManagerBuilder(TT)();
+
+            // bodies link against the stubs, not each other, so compiling
+            // one never drags in the definitions it calls
+            auto ImplJD = S->JIT->createJITDylib("kaleido.impl");
+            if (!ImplJD)
+                return ImplJD.takeError();
+            S->ImplJD = &*ImplJD;
+            S->ImplJD->setLinkOrder({{S->MainJD, orc::JITDylibLookupFlags::MatchExportedSymbolsOnly},
+                                     {S->ImplJD, orc::JITDylibLookupFlags::MatchAllSymbols}},
+                                    false);
+
+            S->LazyCG = std::make_unique<CodeGen>(Opts.CodeGen, S->Symbols, S->Diags, S->Stats);
+            S->LazyCG->setTargetMachine(S->TM.get());
+            if (S->Prof)
+                S->LazyCG->setProfile(S->Prof.get(), !Opts.ProfileGenerate.empty());
+            S->LazyCG->initializeModule();
+        }
+
+        if (Opts.Tiered) {
+            orc::ExecutionSession &ES = S->JIT->getExecutionSession();
+            S->ISM = orc::createLocalIndirectStubsManagerBuilder(S->JIT->getTargetTriple())();
+            // like lazy bodies, both tiers call through the stubs
+            for (auto [Name, JD] : {std::pair("kaleido.tier0", &S->Tier0JD), std::pair("kaleido.tier1", &S->Tier1JD)}) {
+                auto Dylib = S->JIT->createJITDylib(Name);
+                if (!Dylib)
+                    return Dylib.takeError();
+                *JD = &*Dylib;
+                (*JD)->setLinkOrder({{S->MainJD, orc::JITDylibLookupFlags::MatchExportedSymbolsOnly},
+                                     {*JD, orc::JITDylibLookupFlags::MatchAllSymbols}},
+                                    false);
+            }
+            // tier 1 is the module pipeline at -O3, run on TierPool as the
+            // module is materialised
+            S->TierUpLayer = std::make_unique<orc::IRTransformLayer>(
+                    ES, S->JIT->getIRTransformLayer(),
+                    [TierJTMB](orc::ThreadSafeModule TSM,
+                               orc::MaterializationResponsibility &) mutable -> Expected<orc::ThreadSafeModule> {
+                        auto TM = TierJTMB.createTargetMachine();
+                        if (!TM)
+                            return TM.takeError();
+                        TSM.withModuleDo([&](Module &M) { runModulePipeline(M, OptimizationLevel::O3, **TM); });
+                        return TSM;
+                    });
+            S->TierUpThreshold = Opts.TierUpThreshold;
+            S->TierPool = std::make_unique<ThreadPool>(hardware_concurrency(1));
+        }
+    }
+    S->CG.initializeModule();
+    return S;
+}
+
+CompilerSession::~CompilerSession() {
+    // the shared JIT lives on, so take everything of ours out of it
+    if (LibraryJD) {
+        Definitions.clear();
+        reportError(JIT->getExecutionSession().removeJITDylib(*MainJD));
+    }
+    // tier-ups in flight still add to the profile
+    if (TierPool)
+        TierPool->wait();
+    if (!ProfileOut.empty())
+        Prof->write(ProfileOut, Diags);
+    if (!wantsIR() || CG.getOptions().Batch)
+        return;
+
+    LLVMContext Ctx;
+    Module Linked(SessionBitcode.empty() ? "kaleido" : CG.getOptions().ModuleName, Ctx);
+    for (auto &[Name, BC] : SessionBitcode) {
+        auto M = parseBitcodeFile(MemoryBufferRef(StringRef(BC.data(), BC.size()), Symbols.name(Name)), Ctx);
+        if (!M) {
+            reportError(M.takeError());
+            continue;
+        }
+        (*M)->setModuleIdentifier(Linked.getModuleIdentifier());
+        if (Linker::linkModules(Linked, std::move(*M)))
+            Diags.error("could not link '" + Symbols.name(Name) + "' into the session output");
+    }
+    PhaseTimer T(Stats, Phase::Emit);
+    if (BCOut)
+        WriteBitcodeToFile(Linked, *BCOut);
+    if (IROut)
+        Linked.print(*IROut, nullptr);
+}
+
+bool CompilerSession::openFile(StringRef Path) {
+    if (!Lex.getSource().open(Path, Diags))
+        return false;
+    // somebody at a prompt can keep on trying
+    if (Lex.getSource().isInteractive())
+        Diags.setErrorLimit(0);
+    return true;
+}
+
+void CompilerSession::openMemory(StringRef Text) {
+    Lex.getSource().openMemory(Text);
+}
+
+void CompilerSession::openStream(FILE *In) {
+    Lex.getSource().openStream(In);
+    Diags.setErrorLimit(0);
+}
+
+void CompilerSession::setOutput(raw_ostream &OS) {
+    Out = &OS;
+    Diags.setOutput(OS);
+}
+
+bool CompilerSession::finishLibrary() {
+    if (!Shared) {
+        Diags.error("only a session that shares its JIT can be a library");
+        return false;
+    }
+    orc::ExecutionSession &ES = JIT->getExecutionSession();
+    for (auto &[Name, Proto] : CG.getPrototypes()) {
+        if (Name == SymAnon)
+            continue;
+        LibraryFunction &F = Exports.emplace_back();
+        F.Name = Symbols.name(Name).str();
+        for (Symbol Arg : Proto.getArgs())
+            F.Args.push_back(Symbols.name(Arg).str());
+        F.Effects = CG.getEffects(Name);
+        if (!CG.isDefined(Name))
+            continue;
+        // compiled here, once, rather than by whichever session calls it first
+        PhaseTimer T(Stats, Phase::JIT);
+        auto Addr = ES.lookup({MainJD}, JIT->mangleAndIntern(F.Name));
+        if (reportError(Addr.takeError()))
+            return false;
+        F.Addr = Addr->getAddress();
+    }
+    return true;
+}
+
+Error CompilerSession::attachLibrary(const CompilerSession &Library) {
+    static std::atomic<unsigned> NextSession = 0;
+    JIT = Library.JIT;
+    LibraryJD = Library.MainJD;
+    auto JD = JIT->createJITDylib("kaleido.session." + std::to_string(NextSession++));
+    if (!JD)
+        return JD.takeError();
+    MainJD = &*JD;
+    MainJD->setLinkOrder({{MainJD, orc::JITDylibLookupFlags::MatchAllSymbols},
+                          {LibraryJD, orc::JITDylibLookupFlags::MatchExportedSymbolsOnly}},
+                         false);
+
+    // the library is never redefined, so calls into it are bound for good
+    for (const LibraryFunction &F : Library.Exports) {
+        Symbol Name = Symbols.internCopy(F.Name);
+        SmallVector<Symbol, 4> Args;
+        for (const std::string &Arg : F.Args)
+            Args.push_back(Symbols.internCopy(Arg));
+        CG.recordPrototype(PrototypeAst(Name, Args));
+        CG.setEffects(Name, F.Effects);
+        if (F.Addr) {
+            CG.markDefined(Name);
+            CG.bindAddress(Name, F.Addr);
+        }
+    }
+    return Error::success();
+}
+
+bool CompilerSession::loadBitcode(StringRef Path) {
+    PhaseTimer T(Stats, Phase::Input);
+    auto Buf = MemoryBuffer::getFile(Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!Buf) {
+        Diags.error("could not open '" + Path + "': " + Buf.getError().message());
+        return false;
+    }
+
+    // batch mode links the library into the one module; the JIT gets it as
+    // a module of its own
+    if (CG.getOptions().Batch) {
+        // the object is built from the library as much as from the source
+        if (ObjCache)
+            LibraryDigests += toHex(SHA256::hash(arrayRefFromStringRef((*Buf)->getBuffer()))) + '\0';
+        auto M = getOwningLazyBitcodeModule(std::move(*Buf), CG.getContext());
+        if (!M)
+            return !reportError(M.takeError());
+        registerLibrary(**M);
+        if (Linker::linkModules(CG.getModule(), std::move(*M))) {
+            Diags.error("could not link '" + Path + "'");
+            return false;
+        }
+        return true;
+    }
+
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = getOwningLazyBitcodeModule(std::move(*Buf), *Ctx);
+    if (!M)
+        return !reportError(M.takeError());
+    registerLibrary(**M);
+    PhaseTimer JT(Stats, Phase::JIT);
+    return !reportError(JIT->addIRModule(*MainJD, orc::ThreadSafeModule(std::move(*M), std::move(Ctx))));
+}
+
+/// registerLibrary - every function of M that looks like one of ours, all
+/// doubles, gets a prototype, so that source can call it. Those with bodies
+/// count as defined. Argument names come from the IR when it has them.
+void CompilerSession::registerLibrary(const Module &M) {
+    for (const Function &F : M) {
+        if (F.isIntrinsic() || !F.getReturnType()->isDoubleTy() ||
+            any_of(F.args(), [](const Argument &A) { return !A.getType()->isDoubleTy(); }))
+            continue;
+        Symbol Name = Symbols.internCopy(F.getName());
+        SmallVector<Symbol, 4> Args;
+        for (const Argument &A : F.args()) {
+            std::string ArgName = A.getName().str();
+            if (ArgName.empty() || !all_of(ArgName, isAlnum))
+                ArgName = "a" + std::to_string(A.getArgNo());
+            Args.push_back(Symbols.internCopy(ArgName));
+        }
+        PrototypeAst Proto(Name, Args);
+        CG.recordPrototype(Proto);
+        if (LazyCG)
+            LazyCG->recordPrototype(Proto);
+        if (F.isDeclaration() && !F.isMaterializable())
+            continue;
+        // whatever compiled the library inferred its effects already
+        bool NoMemory = F.doesNotAccessMemory() && F.doesNotThrow();
+        FunctionEffects E{NoMemory, NoMemory, NoMemory && F.willReturn()};
+        CG.setEffects(Name, E);
+        if (LazyCG)
+            LazyCG->setEffects(Name, E);
+        CG.markDefined(Name);
+        LibrarySymbols.push_back(Name);
+    }
+}
+
+void CompilerSession::keepSessionModule(Symbol Name, const Module &M) {
+    SmallVector<char, 0> &BC = SessionBitcode[Name];
+    BC.clear();
+    raw_svector_ostream OS(BC);
+    WriteBitcodeToFile(M, OS);
+}
+
+void CompilerSession::emitIR(const Module &M) {
+    if (!IROut)
+        return;
+    PhaseTimer T(Stats, Phase::Emit);
+    M.print(*IROut, nullptr);
+}
+
+bool CompilerSession::reportError(Error E) {
+    if (!E)
+        return false;
+    Diags.error(toString(std::move(E)));
+    return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Top-Level parsing and JIT driver
+//===----------------------------------------------------------------------===//
+
+void CompilerSession::HandleDefinition() {
+    if (auto FnAST = P.ParseDefinition()) {
+        // an operator is only kept if its definition is
+        bool Compiled = false;
+        if (LCTM) {
+            Compiled = addLazyDefinition(*FnAST);
+        } else if (Tier0JD) {
+            Compiled = addTieredDefinition(*FnAST);
+        } else {
+            Symbol Name = FnAST->getProto().getSymbol();
+            // the table would be filled in by every client thread at once
+            if (Shared && FnAST->getProto().isMemo()) {
+                Diags.error("memo definitions cannot be shared between sessions");
+            } else if (CG.isDefined(Name) && !Definitions.count(Name)) {
+                Diags.error("Function cannot be redefined"); // it came from bitcode
+            } else {
+                // keep the definition, so that it can be rebuilt if a function
+                // it calls is redefined later
+                SavedDefinition Saved = saveDefinition(*FnAST);
+                if (CG.isDefined(Name))
+                    Compiled = redefine(std::move(Saved));
+                else
+                    Compiled = compileDefinition(Saved, /*Verbose=*/!Quiet);
+            }
+        }
+        P.settleBinop(Compiled);
+    } else {
+        P.recover();
+    }
+}
+
+/// EffectsExt - the cache entry beside a definition's object that holds the
+/// effects inferred for it: a hit skips the codegen they come from, and the
+/// keys of its callers depend on them
+static constexpr StringLiteral EffectsExt = ".effects";
+
+/// lookupEffects - the effects cached under Key; None makes the object a miss
+static std::optional<FunctionEffects> lookupEffects(DiskObjectCache &Cache, StringRef Key) {
+    auto Buf = Cache.lookup(Key, EffectsExt);
+    if (!Buf || Buf->getBufferSize() != 3)
+        return std::nullopt;
+    StringRef Flags = Buf->getBuffer();
+    return FunctionEffects{Flags[0] == '1', Flags[1] == '1', Flags[2] == '1'};
+}
+
+static void storeEffects(DiskObjectCache &Cache, StringRef Key, FunctionEffects E) {
+    const char Flags[] = {char('0' + E.Pure), char('0' + E.NoMemory), char('0' + E.Returns)};
+    Cache.store(Key, MemoryBufferRef(StringRef(Flags, sizeof(Flags)), Key), EffectsExt);
+}
+
+CompilerSession::SavedDefinition CompilerSession::saveDefinition(const FunctionAst &Fn) {
+    SavedDefinition Saved;
+    Saved.Ast = std::make_unique<AstContext>(Stats);
+    Saved.Fn = Fn.clone(*Saved.Ast);
+    return Saved;
+}
+
+bool CompilerSession::compileDefinition(SavedDefinition &Saved, bool Verbose) {
+    FunctionAst &Fn = *Saved.Fn;
+    Symbol Name = Fn.getProto().getSymbol();
+    auto RT = MainJD->createResourceTracker();
+
+    // with --emit-llvm the IR is wanted, so the cache is written but not read
+    std::optional<std::string> Key;
+    std::optional<FunctionEffects> Cached;
+    if (ObjCache)
+        Key = definitionCacheKey(Fn, CG);
+    if (Key && !wantsIR())
+        Cached = lookupEffects(*ObjCache, *Key);
+    if (auto Obj = Cached ? ObjCache->lookup(*Key) : nullptr) {
+        ++Stats.CacheHits;
+        if (Verbose)
+            *Out << "Read function definition: " << Symbols.name(Name) << " (cached)\n";
+        CG.recordPrototype(Fn.getProto());
+        CG.setEffects(Name, *Cached);
+        PhaseTimer T(Stats, Phase::JIT);
+        if (reportError(JIT->addObjectFile(RT, std::move(Obj))))
+            return false;
+    } else {
+        // a folded body never folds again, so rebuilds add nothing to the arena
+        Fn.foldConstants(*Saved.Ast);
+        auto *FnIR = Fn.codegen(CG);
+        if (!FnIR)
+            return false;
+        if (Verbose) {
+            *Out << "Read function definition:";
+            FnIR->print(*Out);
+            *Out << "\n";
+        }
+
+        // a keyed module is stored in the cache once it is compiled
+        if (Key) {
+            ++Stats.CacheMisses;
+            CG.getModule().setModuleIdentifier(*Key);
+            storeEffects(*ObjCache, *Key, CG.getEffects(Name));
+        }
+
+        // hand the module to the JIT and start a fresh one
+        if (wantsIR())
+            keepSessionModule(Name, CG.getModule());
+        auto TSM = CG.takeModule();
+        PhaseTimer T(Stats, Phase::JIT);
+        if (reportError(JIT->addIRModule(RT, std::move(TSM))))
+            return false;
+    }
+    CG.markDefined(Name);
+
+    Definition &D = Definitions[Name];
+    D.Saved = std::move(Saved);
+    D.RT = std::move(RT);
+    D.Callees.clear();
+    Fn.getCallees(D.Callees);
+    for (Symbol Callee : D.Callees)
+        Callers[Callee].insert(Name);
+    return true;
+}
+
+/// redefine - every definition is a module of its own, so nothing has the old
+/// body inlined, but every caller has its address bound into its code. The
+/// callers are rebuilt, and so on up the call graph, since rebuilding moves
+/// them too. If the new body does not compile the old one is put back; the
+/// one that is not kept is freed on the way out.
+bool CompilerSession::redefine(SavedDefinition New) {
+    Symbol Name = New.Fn->getProto().getSymbol();
+    SavedDefinition Old;
+
+    SetVector<Symbol> Affected;
+    Affected.insert(Name);
+    for (size_t I = 0; I != Affected.size(); ++I) {
+        auto It = Callers.find(Affected[I]);
+        if (It != Callers.end())
+            Affected.insert(It->second.begin(), It->second.end());
+    }
+
+    // take them all out of the JIT; each is tracked again once it is rebuilt
+    SmallVector<SavedDefinition, 8> Rebuild;
+    {
+        PhaseTimer T(Stats, Phase::JIT);
+        for (Symbol S : Affected) {
+            auto It = Definitions.find(S);
+            reportError(It->second.RT->remove());
+            for (Symbol Callee : It->second.Callees)
+                Callers[Callee].remove(S);
+            if (S != Name)
+                Rebuild.push_back(std::move(It->second.Saved));
+            else
+                Old = std::move(It->second.Saved);
+            Definitions.erase(It);
+            CG.markUndefined(S);
+        }
+    }
+
+    // the new prototype is what everything is rebuilt against
+    CG.recordPrototype(New.Fn->getProto());
+    bool Compiled = compileDefinition(New, /*Verbose=*/!Quiet);
+    if (!Compiled) {
+        Diags.flush();
+        *Out << "Keeping the previous definition of " << Symbols.name(Name) << "\n";
+        CG.recordPrototype(Old.Fn->getProto());
+        compileDefinition(Old, /*Verbose=*/false);
+    }
+
+    // a caller that no longer compiles (say the callee changed its arity) is
+    // dropped, and so is everything above it. Rebuild is in breadth-first
+    // order, so callees come before their callers, bar cycles.
+    DenseSet<Symbol> Dropped;
+    size_t Rebuilt = 0;
+    for (SavedDefinition &Caller : Rebuild) {
+        Symbol S = Caller.Fn->getProto().getSymbol();
+        SmallVector<Symbol, 4> Callees;
+        Caller.Fn->getCallees(Callees);
+        if (none_of(Callees, [&](Symbol C) { return Dropped.contains(C); }) &&
+            compileDefinition(Caller, /*Verbose=*/false)) {
+            ++Rebuilt;
+            continue;
+        }
+        Dropped.insert(S);
+        SessionBitcode.erase(S);
+        Diags.flush();
+        *Out << "Dropped " << Symbols.name(S) << ", which no longer compiles\n";
+    }
+    if (!Quiet)
+        *Out << "Redefined " << Symbols.name(Name) << ", rebuilt " << Rebuilt << " of " << Rebuild.size()
+             << " dependent definition(s)\n";
+    return Compiled;
+}
+
+void CompilerSession::HandleExtern() {
+    if (auto ProtoAST = P.ParseExtern()) {
+        auto *FnIR = ProtoAST->codegen(CG);
+        if (FnIR) {
+            if (!Quiet) {
+                *Out << "Read extern: ";
+                FnIR->print(*Out);
+                *Out << "\n";
+            }
+            CG.recordPrototype(*ProtoAST);
+            if (LazyCG)
+                LazyCG->recordPrototype(*ProtoAST);
+        }
+        P.settleBinop(FnIR);
+    } else {
+        P.recover();
+    }
+}
+
+/// bindCallees - everything an expression that just ran could reach is in
+/// memory now, so later definitions can call it directly instead of through
+/// the linker, which goes via a stub for every call into another module.
+/// Stubs stay in lazy mode, to keep bodies independent, in tiered mode, where
+/// they are what gets swapped, and with the object cache or --emit-bc, since
+/// code that has addresses in it cannot be reused.
+void CompilerSession::bindCallees(ArrayRef<Symbol> Roots) {
+    if (LCTM || Tier0JD || ObjCache || BCOut)
+        return;
+    SmallVector<Symbol, 8> Worklist(Roots.begin(), Roots.end());
+    orc::ExecutionSession &ES = JIT->getExecutionSession();
+    while (!Worklist.empty()) {
+        Symbol Name = Worklist.pop_back_val();
+        if (CG.isBound(Name))
+            continue;
+        auto Addr = ES.lookup({MainJD}, JIT->mangleAndIntern(Symbols.name(Name)));
+        if (!Addr) {
+            consumeError(Addr.takeError());
+            continue;
+        }
+        CG.bindAddress(Name, Addr->getAddress());
+        auto It = Definitions.find(Name);
+        if (It != Definitions.end())
+            Worklist.append(It->second.Callees.begin(), It->second.Callees.end());
+    }
+}
+
+void CompilerSession::HandleTopLevelExpression() {
+    // Evaluate a top-level expression into an anonymous function.
+    if (auto FnAST = P.ParseTopLevelExpr()) {
+        FnAST->foldConstants(Ast);
+        if (Interpret && interpretExpression(*FnAST))
+            return;
+        if (auto *FnIR = FnAST->codegen(CG)) {
+            if (!Quiet) {
+                *Out << "Read top-level expression:";
+                FnIR->print(*Out);
+                *Out << "\n";
+            }
+
+            // Give the expression its own tracker so its code can be freed
+            // once it has run.
+            auto RT = MainJD->createResourceTracker();
+            auto TSM = CG.takeModule();
+            {
+                PhaseTimer T(Stats, Phase::JIT);
+                if (reportError(JIT->addIRModule(RT, std::move(TSM))))
+                    return;
+            }
+
+            // Run it as a native double() function. The lookup is what
+            // materialises the code, so it counts as JIT time.
+            PhaseTimer JT(Stats, Phase::JIT);
+            if (auto ExprSymbol = JIT->lookup(*MainJD, Symbols.name(SymAnon))) {
+                auto *FP = ExprSymbol->toPtr<double (*)()>();
+                double Result;
+                {
+                    PhaseTimer ET(Stats, Phase::Execute);
+                    Result = FP();
+                }
+                if (PrintResults)
+                    *Out << format("Evaluated to %f\n", Result);
+                SmallVector<Symbol, 8> Callees;
+                FnAST->getCallees(Callees);
+                bindCallees(Callees);
+            } else {
+                reportError(ExprSymbol.takeError());
+            }
+
+            // Delete the anonymous expression module from the JIT.
+            reportError(RT->remove());
+        }
+    } else {
+        P.recover();
+    }
+}
+
+bool CompilerSession::interpretExpression(const FunctionAst &Fn) {
+    auto Resolve = [&](Symbol Name) -> void * {
+        // bound functions are free; anything else is a lookup, which is also
+        // what compiles a lazy definition
+        if (uint64_t Addr = CG.getBoundAddress(Name))
+            return jitTargetAddressToPointer<void *>(Addr);
+        auto Addr = lookupFunction(Symbols.name(Name));
+        if (reportError(Addr.takeError()))
+            return nullptr;
+        return *Addr;
+    };
+    Interpreter I(CG, Resolve);
+    if (!I.canInterpret(Fn.getBody()))
+        return false;
+    if (!Quiet)
+        *Out << "Read top-level expression, interpreting it\n";
+
+    std::optional<double> Result;
+    {
+        PhaseTimer ET(Stats, Phase::Execute);
+        Result = I.interpret(Fn.getBody());
+    }
+    ++Stats.Interpreted;
+    if (!Result)
+        return true;
+    if (PrintResults)
+        *Out << format("Evaluated to %f\n", *Result);
+    SmallVector<Symbol, 8> Callees;
+    Fn.getCallees(Callees);
+    bindCallees(Callees);
+    return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Lazy definitions
+//===----------------------------------------------------------------------===//
+
+/// LazyDefinitionUnit - one definition whose IR has not been generated yet
+class LazyDefinitionUnit : public orc::MaterializationUnit {
+    CompilerSession &S;
+    FunctionAst &Fn;
+public:
+    /// Symbols - the function and, if there is one, its map wrapper
+    LazyDefinitionUnit(CompilerSession &S, FunctionAst &Fn, orc::SymbolFlagsMap Symbols)
+            : MaterializationUnit(Interface(std::move(Symbols), nullptr)), S(S), Fn(Fn) {}
+
+    StringRef getName() const override { return "LazyDefinitionUnit"; }
+
+    void materialize(std::unique_ptr<orc::MaterializationResponsibility> R) override {
+        S.materializeDefinition(Fn, std::move(R));
+    }
+
+private:
+    void discard(const orc::JITDylib &, const orc::SymbolStringPtr &) override {
+        llvm_unreachable("kaleido functions are never overridden");
+    }
+};
+
+bool CompilerSession::addLazyDefinition(const FunctionAst &Fn) {
+    Symbol Name = Fn.getProto().getSymbol();
+    if (CG.isDefined(Name)) {
+        Diags.error("Function cannot be redefined");
+        return false;
+    }
+    // the body is generated at its first call, which is too late to find
+    // out that it can never compile
+    auto Lookup = [&](Symbol Callee) { return Callee == Name ? &Fn.getProto() : CG.getPrototype(Callee); };
+    NameChecker Check(Lookup);
+    if (const char *Err = Check.check(Fn)) {
+        Diags.error(Err);
+        return false;
+    }
+    if (!Quiet)
+        *Out << "Read lazy function definition: " << Symbols.name(Name) << "\n";
+
+    // the body outlives this item's arena; it is folded when compiled
+    FunctionAst *Saved = Fn.clone(SavedAst);
+    CG.recordPrototype(Saved->getProto());
+    CG.markDefined(Name);
+    LazyCG->recordPrototype(Saved->getProto());
+
+    auto Flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    orc::SymbolFlagsMap Defined;
+    orc::SymbolAliasMap Stub;
+    Defined[JIT->mangleAndIntern(Symbols.name(Name))] = Flags;
+    if (CG.getOptions().MapWrappers)
+        Defined[JIT->mangleAndIntern(getMapName(Symbols.name(Name)))] = Flags;
+    for (auto &[Mangled, F] : Defined)
+        Stub[Mangled] = orc::SymbolAliasMapEntry(Mangled, F);
+
+    PhaseTimer T(Stats, Phase::JIT);
+    if (reportError(ImplJD->define(std::make_unique<LazyDefinitionUnit>(*this, *Saved, std::move(Defined)))))
+        return false;
+    return !reportError(MainJD->define(orc::lazyReexports(*LCTM, *ISM, *ImplJD, std::move(Stub))));
+}
+
+void CompilerSession::materializeDefinition(FunctionAst &Fn,
+                                            std::unique_ptr<orc::MaterializationResponsibility> R) {
+    std::optional<std::string> Key;
+    if (ObjCache && (Key = definitionCacheKey(Fn, *LazyCG))) {
+        auto Cached = wantsIR() ? std::nullopt : lookupEffects(*ObjCache, *Key);
+        if (auto Obj = Cached ? ObjCache->lookup(*Key) : nullptr) {
+            ++Stats.CacheHits;
+            LazyCG->recordPrototype(Fn.getProto());
+            LazyCG->setEffects(Fn.getProto().getSymbol(), *Cached);
+            PhaseTimer T(Stats, Phase::JIT);
+            JIT->getObjLinkingLayer().emit(std::move(R), std::move(Obj));
+            return;
+        }
+        ++Stats.CacheMisses;
+    }
+
+    // callees whose bodies are in memory already are called directly rather
+    // than through their stubs; the rest are bound once they materialise
+    if (!ObjCache) {
+        SmallVector<Symbol, 8> Callees;
+        Fn.getCallees(Callees);
+        for (Symbol Callee : Callees) {
+            if (!Materialized.contains(Callee) || LazyCG->isBound(Callee))
+                continue;
+            auto Addr = JIT->getExecutionSession().lookup({ImplJD}, JIT->mangleAndIntern(Symbols.name(Callee)));
+            if (Addr)
+                LazyCG->bindAddress(Callee, Addr->getAddress());
+            else
+                consumeError(Addr.takeError());
+        }
+    }
+
+    Fn.foldConstants(SavedAst);
+    if (!Fn.codegen(*LazyCG)) {
+        // a failed call never returns to the REPL loop, so report it now
+        Diags.flush();
+        R->failMaterialization();
+        return;
+    }
+    if (Key) {
+        LazyCG->getModule().setModuleIdentifier(*Key);
+        storeEffects(*ObjCache, *Key, LazyCG->getEffects(Fn.getProto().getSymbol()));
+    }
+    if (wantsIR())
+        keepSessionModule(Fn.getProto().getSymbol(), LazyCG->getModule());
+    auto TSM = LazyCG->takeModule();
+    PhaseTimer T(Stats, Phase::JIT);
+    JIT->getIRTransformLayer().emit(std::move(R), std::move(TSM));
+    Materialized.insert(Fn.getProto().getSymbol());
+}
+
+//===----------------------------------------------------------------------===//
+// Tiered compilation
+//===----------------------------------------------------------------------===//
+
+bool CompilerSession::addTieredDefinition(FunctionAst &Fn) {
+    Symbol Name = Fn.getProto().getSymbol();
+    if (CG.isDefined(Name)) {
+        Diags.error("Function cannot be redefined");
+        return false;
+    }
+
+    Fn.foldConstants(Ast);
+    Function *FnIR = Fn.codegen(CG);
+    if (!FnIR)
+        return false;
+    if (!Quiet) {
+        *Out << "Read function definition:";
+        FnIR->print(*Out);
+        *Out << "\n";
+    }
+    // tier 1 starts over from the IR as it is now, before the call counter
+    SmallVector<char, 0> BC;
+    {
+        raw_svector_ostream OS(BC);
+        WriteBitcodeToFile(CG.getModule(), OS);
+    }
+    if (wantsIR())
+        SessionBitcode[Name] = BC;
+    addTierUpCheck(*FnIR, &TierCounters.emplace_back(0), TierUpThreshold, &requestTierUp, this, Name);
+    {
+        std::lock_guard<std::mutex> Guard(TierLock);
+        TierBitcode[Name] = std::move(BC);
+    }
+    // the body goes in under a name of its own, and everything in the module,
+    // itself included, calls it through the stub: a recursion that gets hot
+    // takes tier 1 as soon as the stub is swapped, rather than only from the
+    // next call from outside
+    std::string BodyName = (Symbols.name(Name) + ".tier0").str();
+    FnIR->setName(BodyName);
+    FnIR->replaceAllUsesWith(Function::Create(FnIR->getFunctionType(), Function::ExternalLinkage,
+                                              Symbols.name(Name), FnIR->getParent()));
+
+    // the stub goes in first, since the body calls itself through it
+    PhaseTimer T(Stats, Phase::JIT);
+    auto Mangled = JIT->mangleAndIntern(Symbols.name(Name));
+    auto Flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    if (reportError(ISM->createStub(*Mangled, pointerToJITTargetAddress(&lazyCallFailed), Flags)))
+        return false;
+    orc::SymbolMap Stub;
+    Stub[Mangled] = ISM->findStub(*Mangled, /*ExportedStubsOnly=*/true);
+    if (reportError(MainJD->define(orc::absoluteSymbols(std::move(Stub)))))
+        return false;
+    if (reportError(JIT->addIRModule(*Tier0JD, CG.takeModule())))
+        return false;
+    auto Body = JIT->getExecutionSession().lookup({Tier0JD}, JIT->mangleAndIntern(BodyName));
+    if (!Body) {
+        reportError(Body.takeError());
+        return false;
+    }
+    if (reportError(ISM->updatePointer(*Mangled, Body->getAddress())))
+        return false;
+    CG.markDefined(Name);
+    return true;
+}
+
+/// requestTierUp - runs inside JIT'd code, so it only queues the work
+void CompilerSession::requestTierUp(void *Session, uint64_t Name) {
+    auto *S = static_cast<CompilerSession *>(Session);
+    SmallVector<char, 0> BC;
+    {
+        std::lock_guard<std::mutex> Guard(S->TierLock);
+        auto It = S->TierBitcode.find(Name);
+        if (It == S->TierBitcode.end())
+            return;
+        BC = std::move(It->second);
+        S->TierBitcode.erase(It);
+    }
+    // the symbol table belongs to the REPL thread, so look the name up here
+    std::string FnName = S->Symbols.name(Name).str();
+    S->TierPool->async([S, Name, FnName = std::move(FnName), BC = std::move(BC)]() mutable {
+        S->tierUp(Name, std::move(FnName), std::move(BC));
+    });
+}
+
+void CompilerSession::tierUp(Symbol Name, std::string FnName, SmallVector<char, 0> Bitcode) {
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = parseBitcodeFile(MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()), FnName), *Ctx);
+    if (!M) {
+        reportError(M.takeError());
+        return;
+    }
+    // only the definition itself moves up; its map wrapper stays at tier 0
+    for (Function &F : **M) {
+        if (!F.isDeclaration() && F.getName() != FnName)
+            F.deleteBody();
+    }
+    (*M)->addModuleFlag(Module::Warning, TierFlag, 1);
+
+    auto Mangled = JIT->mangleAndIntern(FnName);
+    if (reportError(TierUpLayer->add(*Tier1JD, orc::ThreadSafeModule(std::move(*M), std::move(Ctx)))))
+        return;
+    auto Body = JIT->getExecutionSession().lookup({Tier1JD}, Mangled);
+    if (!Body) {
+        reportError(Body.takeError());
+        return;
+    }
+    // one pointer store: a call either takes the old body or the new one
+    if (reportError(ISM->updatePointer(*Mangled, Body->getAddress())))
+        return;
+    std::lock_guard<std::mutex> Guard(TierLock);
+    TieredUp.push_back(Name);
+}
+
+void CompilerSession::reportTierUps() {
+    std::lock_guard<std::mutex> Guard(TierLock);
+    if (!Quiet) {
+        for (Symbol Name : TieredUp)
+            *Out << "Optimised " << Symbols.name(Name) << " at -O3\n";
+    }
+    TieredUp.clear();
+}
+
+//===----------------------------------------------------------------------===//
+// Object cache
+//===----------------------------------------------------------------------===//
+
+/// describeTarget - everything besides the source and -O level that the
+/// generated code depends on
+std::string CompilerSession::describeTarget(const CodegenOptions &Opts) {
+    std::string Text;
+    raw_string_ostream OS(Text);
+    OS << TM->getTargetTriple().str() << '\0' << TM->getTargetCPU() << '\0' << TM->getTargetFeatureString();
+    OS << '\0' << (Opts.MapWrappers ? "map" : "") << '\0' << (Opts.FastMath ? "fast-math" : "");
+    OS.flush();
+    return Text;
+}
+
+/// definitionCacheKey - Fn's canonical text plus the arity each callee has in
+/// Gen right now, which is all its object depends on since every definition
+/// is a module of its own. None when a callee is unknown, so that codegen
+/// gets to report it.
+std::optional<std::string> CompilerSession::definitionCacheKey(const FunctionAst &Fn, const CodeGen &Gen) {
+    std::string Text;
+    raw_string_ostream OS(Text);
+    Fn.print(OS, Symbols);
+
+    SmallVector<Symbol, 8> Callees;
+    Fn.getCallees(Callees);
+    Symbol Self = Fn.getProto().getSymbol();
+    for (Symbol Callee : Callees) {
+        const PrototypeAst *Proto = Callee == Self ? &Fn.getProto() : Gen.getPrototype(Callee);
+        if (!Proto)
+            return std::nullopt;
+        FunctionEffects E = Gen.getEffects(Callee);
+        OS << '\0' << Symbols.name(Callee) << '/' << Proto->getArgs().size() << '/' << E.Pure << E.NoMemory
+           << E.Returns;
+    }
+    OS.flush();
+    return makeCacheKey(Text, Gen.getOptions().OptLevel, describeTarget(Gen.getOptions()));
+}
+
+/// sourceCacheKey - the input's token stream, so that layout and comments do
+/// not matter, after the contents of the libraries linked in. It is lexed
+/// with a scratch lexer to leave the session's symbols and counters alone.
+std::string CompilerSession::sourceCacheKey() {
+    SourceBuffer &Source = Lex.getSource();
+    RunStats ScratchStats;
+    SymbolTable ScratchSymbols;
+    Lexer L(ScratchSymbols, ScratchStats);
+    L.getSource().openMemory(StringRef(Source.cur(), Source.end() - Source.cur()));
+
+    // each worker compiles a shard of its own and inlining stops at shard
+    // boundaries, so the object depends on how many workers there are
+    unsigned Workers = Jobs == 1 ? 1 : hardware_concurrency(Jobs).compute_thread_count();
+    std::string Text = LibraryDigests;
+    raw_string_ostream OS(Text);
+    OS << "j" << Workers << '\0';
+    for (int Tok = L.gettok(); Tok != tok_eof; Tok = L.gettok()) {
+        switch (Tok) {
+            case tok_def:
+                OS << "def ";
+                break;
+            case tok_extern:
+                OS << "extern ";
+                break;
+            case tok_ident:
+            case tok_if:
+            case tok_then:
+            case tok_else:
+            case tok_for:
+            case tok_in:
+            case tok_var:
+                OS << L.getIdentStr() << ' ';
+                break;
+            case tok_num:
+                OS << format("%a ", L.getNumVal());
+                break;
+            default:
+                OS << static_cast<char>(Tok) << ' ';
+                break;
+        }
+    }
+    OS.flush();
+    return makeCacheKey(Text, CG.getOptions().OptLevel, describeTarget(CG.getOptions()));
+}
+
+/// lookupFunction - lazy bodies are looked up in ImplJD, compiling them now,
+/// so that the caller gets the body itself rather than its stub
+Expected<void *> CompilerSession::lookupFunction(StringRef Name) {
+    if (!JIT)
+        return createStringError(inconvertibleErrorCode(), "there is no JIT with -c");
+    SmallVector<orc::JITDylib *, 2> Dylibs;
+    if (ImplJD)
+        Dylibs.push_back(ImplJD);
+    Dylibs.push_back(MainJD);
+    if (LibraryJD)
+        Dylibs.push_back(LibraryJD);
+    // map wrappers have no stubs; they stay at tier 0
+    if (Tier0JD)
+        Dylibs.push_back(Tier0JD);
+
+    PhaseTimer T(Stats, Phase::JIT);
+    auto Sym = JIT->getExecutionSession().lookup(Dylibs, JIT->mangleAndIntern(Name));
+    if (!Sym)
+        return Sym.takeError();
+    return jitTargetAddressToPointer<void *>(Sym->getAddress());
+}
+
+Expected<kaleido_map_fn> CompilerSession::lookupMap(StringRef Name) {
+    auto Addr = lookupFunction(getMapName(Name));
+    if (!Addr)
+        return Addr.takeError();
+    return reinterpret_cast<kaleido_map_fn>(*Addr);
+}
+
+bool CompilerSession::addHostFunction(StringRef Name, void *Fn, unsigned Arity) {
+    if (!JIT) {
+        Diags.error("host functions need the JIT");
+        return false;
+    }
+    Symbol Sym = Symbols.internCopy(Name);
+    if (CG.isDefined(Sym)) {
+        Diags.error("Function cannot be redefined");
+        return false;
+    }
+
+    auto Flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    orc::SymbolMap Host;
+    Host[JIT->mangleAndIntern(Name)] = JITEvaluatedSymbol(pointerToJITTargetAddress(Fn), Flags);
+    if (reportError(MainJD->define(orc::absoluteSymbols(std::move(Host)))))
+        return false;
+
+    // declared as if by an extern, and defined for good: calls to it can be
+    // bound straight to Fn unless the code is to be reused elsewhere
+    SmallVector<Symbol, 4> Args;
+    for (unsigned I = 0; I != Arity; ++I)
+        Args.push_back(Symbols.internCopy("a" + std::to_string(I)));
+    PrototypeAst Proto(Sym, Args);
+    CG.recordPrototype(Proto);
+    CG.markDefined(Sym);
+    if (LazyCG)
+        LazyCG->recordPrototype(Proto);
+    if (!ObjCache && !BCOut) {
+        CG.bindAddress(Sym, pointerToJITTargetAddress(Fn));
+        if (LazyCG)
+            LazyCG->bindAddress(Sym, pointerToJITTargetAddress(Fn));
+    }
+    return true;
+}
+
+/// top ::= definition | external | expression | ';'
+void CompilerSession::run() {
+    if (!Quiet)
+        *Out << "ready> ";
+    P.getNextToken();
+
+    while (true) {
+        if (!Quiet)
+            *Out << "ready> ";
+        switch (P.getCurTok()) {
+            case tok_eof:
+                // tier-ups still in flight are reported before the end
+                if (TierPool) {
+                    TierPool->wait();
+                    reportTierUps();
+                    Out->flush();
+                }
+                return;
+            case ';': // ignore top-level semicolons.
+                P.getNextToken();
+                break;
+            case tok_def:
+                HandleDefinition();
+                break;
+            case tok_extern:
+                HandleExtern();
+                break;
+            default:
+                HandleTopLevelExpression();
+                break;
+        }
+        // the item is done with; drop its whole tree at once
+        Ast.reset();
+        if (TierPool)
+            reportTierUps();
+        Diags.flush();
+        Out->flush();
+        if (Diags.tooManyErrors())
+            return;
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Batch compilation to an object file
+//===----------------------------------------------------------------------===//
+
+/// compileSerial - the -c counterpart of run. Every definition and extern
+/// goes into the one module, with nothing printed per item.
+void CompilerSession::compileSerial() {
+    P.getNextToken();
+
+    while (P.getCurTok() != tok_eof && !Diags.tooManyErrors()) {
+        switch (P.getCurTok()) {
+            case ';':
+                P.getNextToken();
+                break;
+            case tok_def:
+                if (auto FnAST = P.ParseDefinition()) {
+                    FnAST->foldConstants(Ast);
+                    P.settleBinop(FnAST->codegen(CG));
+                } else {
+                    P.recover();
+                }
+                break;
+            case tok_extern:
+                if (auto ProtoAST = P.ParseExtern()) {
+                    // as in the REPL, the prototype is what carries 'pure'
+                    if (!CG.getModule().getFunction(Symbols.name(ProtoAST->getSymbol())) &&
+                        ProtoAST->codegen(CG))
+                        CG.recordPrototype(*ProtoAST);
+                } else {
+                    P.recover();
+                }
+                break;
+            default:
+                // there is nothing to run them at build time
+                P.LogError("top-level expressions cannot be compiled with -c");
+                if (!P.ParseTopLevelExpr())
+                    P.recover();
+                break;
+        }
+        Ast.reset();
+    }
+}
+
+namespace {
+/// BatchItem - a definition or an extern, kept in input order
+using BatchItem = PointerUnion<FunctionAst *, PrototypeAst *>;
+
+/// Shard - a contiguous run of items compiled by one worker
+struct Shard {
+    size_t Begin = 0, End = 0;
+    RunStats Stats;
+    /// the worker's finished module, as bitcode so it can cross contexts
+    SmallVector<char, 0> Bitcode;
+};
+} // namespace
+
+/// compileParallel - parse and fold the whole input on this thread, then split
+/// the items into one shard per worker. Each worker compiles and optimises its
+/// shard in a module of its own context, seeing the prototypes of every item
+/// before the shard just as compileSerial would. The modules are linked back
+/// in input order, so the object file does not depend on scheduling. Emitting
+/// that one object file stays on this thread.
+void CompilerSession::compileParallel() {
+    std::vector<BatchItem> Items;
+    // what the item's function is known to do once the item has been read,
+    // as compileSerial's CodeGen would have it, for the shards after it
+    std::vector<FunctionEffects> ItemEffects;
+    DenseSet<Symbol> Defined;
+
+    P.getNextToken();
+    while (P.getCurTok() != tok_eof && !Diags.tooManyErrors()) {
+        switch (P.getCurTok()) {
+            case ';':
+                P.getNextToken();
+                break;
+            case tok_def:
+                if (auto FnAST = P.ParseDefinition()) {
+                    // shards cannot see each other's bodies, so catch
+                    // redefinitions while everything is still in one place
+                    Symbol Name = FnAST->getProto().getSymbol();
+                    if (CG.isDefined(Name) || !Defined.insert(Name).second) {
+                        Diags.error("Function cannot be redefined");
+                        P.settleBinop(false);
+                        break;
+                    }
+                    FnAST->foldConstants(Ast);
+                    FunctionEffects E = CG.predictEffects(*FnAST);
+                    CG.recordPrototype(FnAST->getProto());
+                    CG.setEffects(Name, E);
+                    Items.push_back(FnAST);
+                    ItemEffects.push_back(E);
+                } else {
+                    P.recover();
+                }
+                break;
+            case tok_extern:
+                if (auto ProtoAST = P.ParseExtern()) {
+                    // a function that is declared already keeps what it has
+                    Symbol Name = ProtoAST->getSymbol();
+                    if (!CG.getPrototype(Name))
+                        CG.recordPrototype(*ProtoAST);
+                    Items.push_back(ProtoAST);
+                    ItemEffects.push_back(CG.getEffects(Name));
+                } else {
+                    P.recover();
+                }
+                break;
+            default:
+                P.LogError("top-level expressions cannot be compiled with -c");
+                if (!P.ParseTopLevelExpr())
+                    P.recover();
+                break;
+        }
+        // the arena is not reset: the items are compiled after parsing ends
+    }
+    if (Diags.getNumErrors() || Items.empty())
+        return;
+
+    ThreadPoolStrategy Strategy = hardware_concurrency(Jobs);
+    unsigned NumShards = std::min<size_t>(Strategy.compute_thread_count(), Items.size());
+    std::deque<Shard> Shards;
+    for (unsigned I = 0; I != NumShards; ++I) {
+        Shard &Sh = Shards.emplace_back();
+        Sh.Begin = Items.size() * I / NumShards;
+        Sh.End = Items.size() * (I + 1) / NumShards;
+    }
+
+    auto CompileShard = [&](Shard &Sh) {
+        // the TargetMachine is not shared between threads
+        auto TM = createHostTargetMachine(CG.getOptions());
+        if (!TM) {
+            reportError(TM.takeError());
+            return;
+        }
+        CodeGen W(CG.getOptions(), Symbols, Diags, Sh.Stats);
+        W.setTargetMachine(TM->get());
+        W.setProfile(Prof.get(), false);
+        W.initializeModule();
+
+        // recording a prototype forgets the effects inferred for a body, so
+        // they are put back, as they stood after each item
+        for (Symbol Name : LibrarySymbols) {
+            W.recordPrototype(*CG.getPrototype(Name));
+            W.setEffects(Name, CG.getEffects(Name));
+        }
+        auto RecordItem = [&](size_t I) {
+            auto *Fn = Items[I].dyn_cast<FunctionAst *>();
+            const PrototypeAst &Proto = Fn ? Fn->getProto() : *Items[I].get<PrototypeAst *>();
+            W.recordPrototype(Proto);
+            W.setEffects(Proto.getSymbol(), ItemEffects[I]);
+        };
+        for (size_t I = 0; I != Sh.Begin; ++I)
+            RecordItem(I);
+        for (size_t I = Sh.Begin; I != Sh.End; ++I) {
+            if (auto *Fn = Items[I].dyn_cast<FunctionAst *>()) {
+                Fn->codegen(W);
+            } else {
+                auto *Proto = Items[I].get<PrototypeAst *>();
+                if (!W.getModule().getFunction(Symbols.name(Proto->getSymbol())) && Proto->codegen(W))
+                    RecordItem(I);
+            }
+        }
+
+        // each shard gets the whole-module pipeline, so inlining stops at
+        // shard boundaries
+        if (!W.optimizeModule())
+            return;
+        raw_svector_ostream OS(Sh.Bitcode);
+        WriteBitcodeToFile(W.getModule(), OS);
+    };
+
+    {
+        // the workers' own verify and optimize time is part of this
+        PhaseTimer T(Stats, Phase::Codegen);
+        ThreadPool Pool(Strategy);
+        for (Shard &Sh : Shards)
+            Pool.async(CompileShard, std::ref(Sh));
+        Pool.wait();
+    }
+
+    PhaseTimer T(Stats, Phase::Link);
+    for (Shard &Sh : Shards) {
+        Stats.addCounters(Sh.Stats);
+        if (Sh.Bitcode.empty())
+            continue;
+        auto M = parseBitcodeFile(MemoryBufferRef(StringRef(Sh.Bitcode.data(), Sh.Bitcode.size()), "shard"),
+                                  CG.getContext());
+        if (reportError(M.takeError()))
+            continue;
+        if (Linker::linkModules(CG.getModule(), std::move(*M)))
+            Diags.error("could not link the compiled definitions");
+    }
+}
+
+bool CompilerSession::compileToObject(StringRef Filename) {
+    auto FlushDiags = make_scope_exit([this] { Diags.flush(); });
+
+    // an interactive terminal has no input to hash up front
+    std::optional<std::string> Key;
+    if (ObjCache && !Lex.getSource().isInteractive()) {
+        Key = sourceCacheKey();
+        if (auto Obj = wantsIR() ? nullptr : ObjCache->lookup(*Key)) {
+            ++Stats.CacheHits;
+            std::error_code EC;
+            raw_fd_ostream Dest(Filename, EC, sys::fs::OF_None);
+            if (EC) {
+                Diags.error("could not open '" + Filename + "': " + EC.message());
+                return false;
+            }
+            Dest << Obj->getBuffer();
+            return true;
+        }
+        ++Stats.CacheMisses;
+    }
+
+    if (Jobs == 1) {
+        compileSerial();
+        if (Diags.getNumErrors() || !CG.optimizeModule())
+            return false;
+    } else {
+        // the linked shards are already optimised
+        compileParallel();
+        if (Diags.getNumErrors())
+            return false;
+    }
+    emitIR(CG.getModule());
+    if (BCOut) {
+        PhaseTimer T(Stats, Phase::Emit);
+        WriteBitcodeToFile(CG.getModule(), *BCOut);
+    }
+    if (!CG.emitObjectFile(Filename))
+        return false;
+
+    if (Key) {
+        if (auto Obj = MemoryBuffer::getFile(Filename, /*IsText=*/false, /*RequiresNullTerminator=*/false))
+            ObjCache->store(*Key, (*Obj)->getMemBufferRef());
+    }
+    return true;
+}
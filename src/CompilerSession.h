@@ -0,0 +1,314 @@
+//
+// CompilerSession.h - one self-contained compiler: input, parser, codegen, JIT
+//
+
+#ifndef KALEIDO_COMPILERSESSION_H
+#define KALEIDO_COMPILERSESSION_H
+
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "AST.h"
+#include "CodeGen.h"
+#include "Diagnostics.h"
+#include "kaleido.h"
+#include "Lexer.h"
+#include "ObjectCache.h"
+#include "Parser.h"
+#include "Profile.h"
+#include "Stats.h"
+
+/// SessionOptions - everything fixed when a session is created
+struct SessionOptions {
+    CodegenOptions CodeGen;
+    /// collect -time-report timings from the start of the session
+    bool Timing = false;
+    /// also time every LLVM pass (needs Timing)
+    bool TimePasses = false;
+    /// threads compiling definitions in batch mode; 0 means one per core
+    unsigned Jobs = 1;
+    /// REPL only: generate code for a definition the first time it is called
+    bool Lazy = false;
+    /// REPL only: compile definitions at -O0 at once, and again at -O3 in the
+    /// background once they have been called TierUpThreshold times, which
+    /// must be at least 1
+    bool Tiered = false;
+    unsigned TierUpThreshold = 1000;
+    /// directory of the persistent object cache; empty disables it
+    std::string CacheDir;
+    /// stop after this many errors; 0 means never. Interactive input never
+    /// stops.
+    unsigned ErrorLimit = 20;
+    /// REPL: no prompts and no echo of each item's IR
+    bool Quiet = false;
+    /// REPL: print what each top-level expression evaluates to
+    bool PrintResults = true;
+    /// REPL: evaluate top-level expressions without loops straight from the
+    /// AST instead of compiling them; calls still run compiled code
+    bool Interpret = true;
+    /// write the IR of every module compiled to this file; empty for none
+    std::string EmitLLVM;
+    /// write the compiled definitions to this file as bitcode; empty for none
+    std::string EmitBC;
+    /// JIT only: count what every definition does, and write the counts to
+    /// this file when the session ends; empty for none
+    std::string ProfileGenerate;
+    /// optimise with the counts in this file, from an earlier
+    /// ProfileGenerate run; empty for none
+    std::string ProfileUse;
+    /// JIT only: let sessions on other threads be created on top of this
+    /// one, sharing its JIT and calling what it defines
+    bool ShareJIT = false;
+};
+
+/// CompilerSession - owns all the state of one compilation: the symbol table,
+/// lexer, parser, AST arena, codegen, the host TargetMachine and, unless in
+/// batch mode, the JIT. Sessions share nothing, so several can live in one
+/// process, unless one is created on top of a library session: it then
+/// shares the library's JIT, with a dylib of its own in front of the
+/// library's, and the library must outlive it.
+class CompilerSession {
+    RunStats Stats;
+    Diagnostics Diags;
+    SymbolTable Symbols;
+    Lexer Lex;
+    AstContext Ast;
+    Parser P;
+    std::unique_ptr<DiskObjectCache> ObjCache;
+    /// Prof - profile being collected and/or used, and where it is written
+    std::unique_ptr<Profile> Prof;
+    std::string ProfileOut;
+    std::unique_ptr<llvm::TargetMachine> TM;
+    /// JIT - OwnedJIT, or the library's JIT. MainJD is where this session's
+    /// definitions go, and LibraryJD the library's dylib behind it, if any.
+    std::unique_ptr<llvm::orc::LLJIT> OwnedJIT;
+    llvm::orc::LLJIT *JIT = nullptr;
+    llvm::orc::JITDylib *MainJD = nullptr;
+    llvm::orc::JITDylib *LibraryJD = nullptr;
+    /// Shared - sessions on other threads may be created on top of this one
+    bool Shared = false;
+    CodeGen CG;
+    unsigned Jobs;
+    bool Quiet;
+    bool PrintResults;
+    bool Interpret;
+    /// IROut/BCOut - the --emit-llvm and --emit-bc files. With either, the
+    /// REPL keeps the bitcode of every live definition in SessionBitcode and
+    /// links it into one module at the end, which both are written from.
+    std::unique_ptr<llvm::raw_fd_ostream> IROut;
+    std::unique_ptr<llvm::raw_fd_ostream> BCOut;
+    llvm::MapVector<Symbol, llvm::SmallVector<char, 0>> SessionBitcode;
+    /// LibrarySymbols - functions defined by loaded bitcode
+    llvm::SmallVector<Symbol, 0> LibrarySymbols;
+    /// LibraryDigests - batch mode with the cache: the hash of every library
+    /// linked in, in order, which sourceCacheKey starts with
+    std::string LibraryDigests;
+    /// Out - where the REPL prints results, IR and diagnostics
+    llvm::raw_ostream *Out = &llvm::errs();
+
+    /// LibraryFunction - a function of a finished library session, as the
+    /// sessions on top of it declare it. Addr is 0 for an extern.
+    struct LibraryFunction {
+        std::string Name;
+        llvm::SmallVector<std::string, 4> Args;
+        FunctionEffects Effects;
+        uint64_t Addr = 0;
+    };
+    std::vector<LibraryFunction> Exports;
+
+    /// SavedAst - lazy bodies, kept past their item for as long as the
+    /// session since a lazy definition is never replaced
+    AstContext SavedAst;
+
+    /// SavedDefinition - an eager definition kept past its item so that it can
+    /// be rebuilt when something it calls changes. It has an arena of its own,
+    /// which goes with it once it is replaced or dropped.
+    struct SavedDefinition {
+        std::unique_ptr<AstContext> Ast;
+        FunctionAst *Fn = nullptr;
+    };
+
+    /// Definition - an eager definition as the JIT has it, freed through its
+    /// own tracker
+    struct Definition {
+        SavedDefinition Saved;
+        llvm::orc::ResourceTrackerSP RT;
+        llvm::SmallVector<Symbol, 4> Callees;
+    };
+    llvm::DenseMap<Symbol, Definition> Definitions;
+    /// Callers - reverse call edges between definitions
+    llvm::DenseMap<Symbol, llvm::SmallSetVector<Symbol, 4>> Callers;
+
+    /// lazy mode: bodies wait in SavedAst until a call through one of the
+    /// LCTM stubs in the main dylib materialises them into ImplJD, using a
+    /// CodeGen of their own since the call can come at any time
+    std::unique_ptr<CodeGen> LazyCG;
+    llvm::orc::JITDylib *ImplJD = nullptr;
+    std::unique_ptr<llvm::orc::LazyCallThroughManager> LCTM;
+    std::unique_ptr<llvm::orc::IndirectStubsManager> ISM;
+    /// Materialized - lazy definitions whose bodies have been emitted
+    llvm::DenseSet<Symbol> Materialized;
+
+    /// tiered mode: every definition is called through an ISM stub in the
+    /// main dylib. Its -O0 body goes into Tier0JD, counting its calls in
+    /// TierCounters; once it is hot its saved IR is optimised through
+    /// TierUpLayer into Tier1JD on TierPool, and the stub is pointed there.
+    llvm::orc::JITDylib *Tier0JD = nullptr;
+    llvm::orc::JITDylib *Tier1JD = nullptr;
+    std::unique_ptr<llvm::orc::IRTransformLayer> TierUpLayer;
+    uint64_t TierUpThreshold = 0;
+    std::deque<uint64_t> TierCounters;
+    /// TierLock - guards TierBitcode and TieredUp, which TierPool shares
+    std::mutex TierLock;
+    llvm::DenseMap<Symbol, llvm::SmallVector<char, 0>> TierBitcode;
+    /// TieredUp - definitions optimised since the REPL last said so
+    llvm::SmallVector<Symbol, 4> TieredUp;
+    /// TierPool - last, so that it is joined before anything its jobs use
+    std::unique_ptr<llvm::ThreadPool> TierPool;
+
+    explicit CompilerSession(const SessionOptions &Opts);
+public:
+    /// create - a session ready to read input. Batch sessions build for the
+    /// host target, all others get a JIT that resolves externs in the process.
+    /// On top of a Library, which finishLibrary has been called on, the
+    /// session uses the library's JIT and can call everything it defines.
+    static llvm::Expected<std::unique_ptr<CompilerSession>> create(const SessionOptions &Opts,
+                                                                   const CompilerSession *Library = nullptr);
+    /// with --emit-llvm or --emit-bc, the REPL writes its definitions out
+    /// here, and the profile is written with ProfileGenerate
+    ~CompilerSession();
+
+    /// openFile - read from Path, or stdin when Path is "-"
+    bool openFile(llvm::StringRef Path);
+    /// openMemory - read Text, which must outlive the session
+    void openMemory(llvm::StringRef Text);
+    /// openStream - read In line by line, such as a socket, without closing it
+    void openStream(FILE *In);
+    /// setOutput - print results, IR and diagnostics to OS rather than stderr
+    void setOutput(llvm::raw_ostream &OS);
+
+    /// loadBitcode - make the functions of a bitcode file, such as one written
+    /// by --emit-bc, callable as if they had been defined. The file is mapped
+    /// and its bodies are only read when they are compiled.
+    bool loadBitcode(llvm::StringRef Path);
+
+    /// run - the REPL: JIT every definition, run every top-level expression
+    void run();
+
+    /// compileToObject - compile the whole input into one object file. With
+    /// more than one job, definitions are compiled on a thread pool first.
+    bool compileToObject(llvm::StringRef Filename);
+
+    /// finishLibrary - compile every definition of a ShareJIT session, once,
+    /// so that sessions can be created on top of it. Nothing may be added to
+    /// it afterwards.
+    bool finishLibrary();
+
+    /// lookupFunction - the address of the JIT'd function Name. It stays
+    /// valid until the session is destroyed, or until Name or anything it
+    /// calls, transitively, is redefined, which rebuilds Name elsewhere.
+    llvm::Expected<void *> lookupFunction(llvm::StringRef Name);
+    /// lookupMap - the map wrapper of the JIT'd definition Name
+    llvm::Expected<kaleido_map_fn> lookupMap(llvm::StringRef Name);
+
+    /// addHostFunction - define Name as the host's Fn, a function of Arity
+    /// doubles returning double. Source can call it with or without an
+    /// extern, and calls go straight to Fn rather than through a lookup.
+    bool addHostFunction(llvm::StringRef Name, void *Fn, unsigned Arity);
+
+    [[nodiscard]] RunStats &getStats() { return Stats; }
+    [[nodiscard]] Diagnostics &getDiagnostics() { return Diags; }
+    [[nodiscard]] SymbolTable &getSymbols() { return Symbols; }
+    [[nodiscard]] Lexer &getLexer() { return Lex; }
+    [[nodiscard]] AstContext &getAstContext() { return Ast; }
+    [[nodiscard]] Parser &getParser() { return P; }
+    [[nodiscard]] CodeGen &getCodeGen() { return CG; }
+    [[nodiscard]] llvm::orc::LLJIT *getJIT() { return JIT; }
+
+private:
+    void HandleDefinition();
+    void HandleExtern();
+    void HandleTopLevelExpression();
+    /// interpretExpression - run Fn, a top-level expression, through the
+    /// Interpreter. False if it has to be compiled instead.
+    bool interpretExpression(const FunctionAst &Fn);
+    /// bindCallees - bind the addresses of Roots and all they call
+    void bindCallees(llvm::ArrayRef<Symbol> Roots);
+
+    /// saveDefinition - copy Fn out of the item's arena into one of its own
+    SavedDefinition saveDefinition(const FunctionAst &Fn);
+    /// compileDefinition - compile a saved definition into the JIT under a
+    /// tracker of its own, moving it into Definitions; Saved is left alone if
+    /// it does not compile. Verbose prints it as the REPL reads it.
+    bool compileDefinition(SavedDefinition &Saved, bool Verbose);
+    /// redefine - replace a definition, rebuilding everything bound to it.
+    /// False if New did not compile and the old definition was kept.
+    bool redefine(SavedDefinition New);
+
+    /// addLazyDefinition - keep Fn's body and put a call-through stub for it
+    /// in the main dylib. False if it was rejected.
+    bool addLazyDefinition(const FunctionAst &Fn);
+    /// materializeDefinition - generate and hand over the code for a lazy
+    /// definition at its first call
+    void materializeDefinition(FunctionAst &Fn, std::unique_ptr<llvm::orc::MaterializationResponsibility> R);
+    friend class LazyDefinitionUnit;
+
+    /// addTieredDefinition - compile Fn at -O0 right away, behind a stub
+    bool addTieredDefinition(FunctionAst &Fn);
+    /// requestTierUp - called by tier-0 code once Name is hot
+    static void requestTierUp(void *Session, uint64_t Name);
+    /// tierUp - on TierPool: optimise Name's saved IR and swap its stub over
+    void tierUp(Symbol Name, std::string FnName, llvm::SmallVector<char, 0> Bitcode);
+    /// reportTierUps - tell the REPL which definitions were optimised
+    void reportTierUps();
+
+    /// compileSerial/compileParallel - fill CG's module for compileToObject
+    void compileSerial();
+    void compileParallel();
+
+    /// definitionCacheKey/sourceCacheKey - object cache keys for one
+    /// definition (JIT) and for the whole input (batch)
+    std::optional<std::string> definitionCacheKey(const FunctionAst &Fn, const CodeGen &Gen);
+    std::string sourceCacheKey();
+    std::string describeTarget(const CodegenOptions &Opts);
+
+    /// emitIR - append M, the batch module, to the --emit-llvm file, if any
+    void emitIR(const llvm::Module &M);
+    /// keepSessionModule - keep M as the IR of the definition Name, to be
+    /// linked into the files written at the end of the REPL
+    void keepSessionModule(Symbol Name, const llvm::Module &M);
+    /// wantsIR - whether compiled IR is being written, which rules out
+    /// reading the object cache
+    [[nodiscard]] bool wantsIR() const { return IROut || BCOut; }
+    /// registerLibrary - declare the double functions M defines
+    void registerLibrary(const llvm::Module &M);
+
+    /// attachLibrary - share Library's JIT, and declare what it defines
+    llvm::Error attachLibrary(const CompilerSession &Library);
+
+    /// reportError - report E if it is a failure; true when it was
+    bool reportError(llvm::Error E);
+};
+
+#endif // KALEIDO_COMPILERSESSION_H
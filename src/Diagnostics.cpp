@@ -0,0 +1,34 @@
+//
+// Diagnostics.cpp - error reporting shared by every stage of a session
+//
+
+#include "Diagnostics.h"
+
+#include <cstdio>
+
+using namespace llvm;
+
+void Diagnostics::error(const Twine &Msg) {
+    unsigned N = ++NumErrors;
+    if (ErrorLimit && N > ErrorLimit)
+        return;
+
+    std::string Str = ("Error: " + Msg + "\n").str();
+    if (N == ErrorLimit)
+        Str += "Error: too many errors, stopping\n";
+    std::lock_guard<std::mutex> Guard(Lock);
+    Buffer += Str;
+}
+
+void Diagnostics::flush() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Buffer.empty())
+        return;
+    if (Out) {
+        *Out << Buffer;
+        Out->flush();
+    } else {
+        fputs(Buffer.c_str(), stderr);
+    }
+    Buffer.clear();
+}
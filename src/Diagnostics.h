@@ -0,0 +1,50 @@
+//
+// Diagnostics.h - error reporting shared by every stage of a session
+//
+
+#ifndef KALEIDO_DIAGNOSTICS_H
+#define KALEIDO_DIAGNOSTICS_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// Diagnostics - collects errors and counts them, so a session can tell
+/// whether anything went wrong (batch mode fails if it did). Messages are
+/// buffered and written out by flush, which the session calls once per
+/// top-level item; codegen workers report through the same object, so the
+/// count is atomic and the buffer locked.
+///
+/// After ErrorLimit errors (if not 0) further ones are only counted, and
+/// tooManyErrors tells the session to stop reading input. Interactive
+/// sessions have no limit.
+class Diagnostics {
+    std::atomic<unsigned> NumErrors = 0;
+    unsigned ErrorLimit;
+    std::mutex Lock;
+    std::string Buffer;
+    /// Out - where flush writes to; stderr when null
+    llvm::raw_ostream *Out = nullptr;
+public:
+    explicit Diagnostics(unsigned ErrorLimit = 0) : ErrorLimit(ErrorLimit) {}
+    ~Diagnostics() { flush(); }
+    Diagnostics(const Diagnostics &) = delete;
+    Diagnostics &operator=(const Diagnostics &) = delete;
+
+    void error(const llvm::Twine &Msg);
+
+    /// flush - write out the buffered messages
+    void flush();
+    /// setOutput - flush to OS from now on; it must outlive us
+    void setOutput(llvm::raw_ostream &OS) { Out = &OS; }
+
+    void setErrorLimit(unsigned Limit) { ErrorLimit = Limit; }
+
+    [[nodiscard]] unsigned getNumErrors() const { return NumErrors; }
+    [[nodiscard]] bool tooManyErrors() const { return ErrorLimit && NumErrors >= ErrorLimit; }
+};
+
+#endif // KALEIDO_DIAGNOSTICS_H
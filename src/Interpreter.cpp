@@ -0,0 +1,225 @@
+//
+// Interpreter.cpp - evaluate one-shot top-level expressions without compiling them
+//
+
+#include "Interpreter.h"
+
+#include "llvm/Support/ErrorHandling.h"
+
+using namespace llvm;
+
+bool Interpreter::canInterpret(const ExprAst &E) {
+    Nodes = 0;
+    bool Ok = E.canInterpret(*this);
+    Vars.clear();
+    return Ok;
+}
+
+std::optional<double> Interpreter::interpret(const ExprAst &E) {
+    Failed = false;
+    double Result = E.interpret(*this);
+    Vars.clear();
+    if (Failed)
+        return std::nullopt;
+    return Result;
+}
+
+bool Interpreter::canCall(Symbol Callee, size_t NumArgs) const {
+    const PrototypeAst *Proto = CG.getPrototype(Callee);
+    return Proto && Proto->getArgs().size() == NumArgs && NumArgs <= MaxArgs;
+}
+
+double *Interpreter::lookup(Symbol Name) {
+    for (auto &Var : llvm::reverse(Vars))
+        if (Var.first == Name)
+            return &Var.second;
+    return nullptr;
+}
+
+/// callWith - call Fn, a double(double...) of as many arguments as Idx has
+template <size_t... Idx>
+static double callWith(void *Fn, [[maybe_unused]] ArrayRef<double> Args, std::index_sequence<Idx...>) {
+    using FnTy = double (*)(decltype((void)Idx, 0.0)...);
+    return reinterpret_cast<FnTy>(Fn)(Args[Idx]...);
+}
+
+double Interpreter::call(Symbol Callee, ArrayRef<double> Args) {
+    void *Fn = Failed ? nullptr : Resolve(Callee);
+    if (!Fn) {
+        Failed = true;
+        return 0.0;
+    }
+    static_assert(MaxArgs == 8, "callWith is instantiated up to MaxArgs");
+    switch (Args.size()) {
+        case 0: return callWith(Fn, Args, std::make_index_sequence<0>());
+        case 1: return callWith(Fn, Args, std::make_index_sequence<1>());
+        case 2: return callWith(Fn, Args, std::make_index_sequence<2>());
+        case 3: return callWith(Fn, Args, std::make_index_sequence<3>());
+        case 4: return callWith(Fn, Args, std::make_index_sequence<4>());
+        case 5: return callWith(Fn, Args, std::make_index_sequence<5>());
+        case 6: return callWith(Fn, Args, std::make_index_sequence<6>());
+        case 7: return callWith(Fn, Args, std::make_index_sequence<7>());
+        case 8: return callWith(Fn, Args, std::make_index_sequence<8>());
+    }
+    llvm_unreachable("canInterpret lets no bigger call through");
+}
+
+//===----------------------------------------------------------------------===//
+// The nodes
+//===----------------------------------------------------------------------===//
+
+// canInterpret mirrors the checks codegen makes, and interpret does what the
+// code codegen generates does, in the same order.
+
+bool ExprAst::canInterpret(Interpreter &I) const {
+    if (!I.countNode())
+        return false;
+    switch (getKind()) {
+        case EK_Num:
+            return cast<NumExprAst>(this)->canInterpret(I);
+        case EK_Var:
+            return cast<VarExprAst>(this)->canInterpret(I);
+        case EK_Bin:
+            return cast<BinExprAst>(this)->canInterpret(I);
+        case EK_Call:
+            return cast<CallExprAst>(this)->canInterpret(I);
+        case EK_If:
+            return cast<IfExprAst>(this)->canInterpret(I);
+        case EK_For:
+            // a loop can run long enough to repay compiling it
+            return false;
+        case EK_VarIn:
+            return cast<VarInExprAst>(this)->canInterpret(I);
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+double ExprAst::interpret(Interpreter &I) const {
+    switch (getKind()) {
+        case EK_Num:
+            return cast<NumExprAst>(this)->interpret(I);
+        case EK_Var:
+            return cast<VarExprAst>(this)->interpret(I);
+        case EK_Bin:
+            return cast<BinExprAst>(this)->interpret(I);
+        case EK_Call:
+            return cast<CallExprAst>(this)->interpret(I);
+        case EK_If:
+            return cast<IfExprAst>(this)->interpret(I);
+        case EK_For:
+            break;
+        case EK_VarIn:
+            return cast<VarInExprAst>(this)->interpret(I);
+    }
+    llvm_unreachable("canInterpret lets no loop through");
+}
+
+bool NumExprAst::canInterpret(Interpreter &) const {
+    return true;
+}
+
+double NumExprAst::interpret(Interpreter &) const {
+    return Val;
+}
+
+bool VarExprAst::canInterpret(Interpreter &I) const {
+    return I.lookup(Name) != nullptr;
+}
+
+double VarExprAst::interpret(Interpreter &I) const {
+    return *I.lookup(Name);
+}
+
+bool BinExprAst::canInterpret(Interpreter &I) const {
+    if (Op == '=') {
+        auto *Dest = dyn_cast<VarExprAst>(Lhs);
+        return Dest && Rhs->canInterpret(I) && I.lookup(Dest->getName());
+    }
+    if (!Lhs->canInterpret(I) || !Rhs->canInterpret(I))
+        return false;
+    switch (Op) {
+        case '+':
+        case '-':
+        case '*':
+        case '<':
+            return true;
+        default:
+            break;
+    }
+    return Callee && I.canCall(*Callee, 2);
+}
+
+double BinExprAst::interpret(Interpreter &I) const {
+    if (Op == '=') {
+        double Val = Rhs->interpret(I);
+        *I.lookup(cast<VarExprAst>(Lhs)->getName()) = Val;
+        return Val;
+    }
+
+    double L = Lhs->interpret(I);
+    double R = Rhs->interpret(I);
+    switch (Op) {
+        case '+':
+            return L + R;
+        case '-':
+            return L - R;
+        case '*':
+            return L * R;
+        case '<':
+            // fcmp ult: true when either side is NaN
+            return !(L >= R) ? 1.0 : 0.0;
+        default:
+            break;
+    }
+    return I.call(*Callee, {L, R});
+}
+
+bool CallExprAst::canInterpret(Interpreter &I) const {
+    if (!I.canCall(Callee, Args.size()))
+        return false;
+    for (const ExprAst *Arg : Args)
+        if (!Arg->canInterpret(I))
+            return false;
+    return true;
+}
+
+double CallExprAst::interpret(Interpreter &I) const {
+    SmallVector<double, Interpreter::MaxArgs> ArgVals;
+    for (const ExprAst *Arg : Args)
+        ArgVals.push_back(Arg->interpret(I));
+    return I.call(Callee, ArgVals);
+}
+
+bool IfExprAst::canInterpret(Interpreter &I) const {
+    return Cond->canInterpret(I) && Then->canInterpret(I) && Else->canInterpret(I);
+}
+
+double IfExprAst::interpret(Interpreter &I) const {
+    // fcmp one against 0.0: NaN is false
+    double C = Cond->interpret(I);
+    return C < 0.0 || C > 0.0 ? Then->interpret(I) : Else->interpret(I);
+}
+
+bool VarInExprAst::canInterpret(Interpreter &I) const {
+    size_t Mark = I.scope();
+    for (const VarBinding &V : Vars) {
+        if (!V.Init->canInterpret(I))
+            return false;
+        I.bind(V.Name, 0.0);
+    }
+    bool Ok = Body->canInterpret(I);
+    I.unbind(Mark);
+    return Ok;
+}
+
+double VarInExprAst::interpret(Interpreter &I) const {
+    size_t Mark = I.scope();
+    for (const VarBinding &V : Vars) {
+        // evaluated before V is in scope, so var a = a refers to an outer a
+        double Init = V.Init->interpret(I);
+        I.bind(V.Name, Init);
+    }
+    double Result = Body->interpret(I);
+    I.unbind(Mark);
+    return Result;
+}
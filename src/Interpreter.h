@@ -0,0 +1,76 @@
+//
+// Interpreter.h - evaluate one-shot top-level expressions without compiling them
+//
+
+#ifndef KALEIDO_INTERPRETER_H
+#define KALEIDO_INTERPRETER_H
+
+#include <cstddef>
+#include <optional>
+#include <utility>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include "AST.h"
+#include "CodeGen.h"
+#include "Lexer.h"
+
+/// Interpreter - walks the tree of a top-level expression to evaluate it.
+/// An expression runs only once, so building, verifying and JIT compiling a
+/// function for it costs far more than the walk unless it loops. Calls go to
+/// the compiled functions, so everything else behaves exactly as if the
+/// expression had been compiled.
+class Interpreter {
+public:
+    /// Resolver - the address of the function Name, or null once the reason
+    /// it has none has been reported
+    using Resolver = llvm::function_ref<void *(Symbol Name)>;
+
+    /// MaxNodes - bigger expressions are compiled, which also bounds how deep
+    /// the walk recurses
+    static constexpr unsigned MaxNodes = 1024;
+    /// MaxArgs - calls that pass more arguments are compiled
+    static constexpr unsigned MaxArgs = 8;
+private:
+    CodeGen &CG;
+    Resolver Resolve;
+    /// Vars - the locals in scope, innermost last
+    llvm::SmallVector<std::pair<Symbol, double>, 8> Vars;
+    unsigned Nodes = 0;
+    /// Failed - a callee could not be resolved; the rest of the expression
+    /// is skipped so that it has no more side effects
+    bool Failed = false;
+public:
+    Interpreter(CodeGen &CG, Resolver Resolve) : CG(CG), Resolve(Resolve) {}
+
+    /// canInterpret - whether E has no loops, is small, only uses variables
+    /// it binds, and only calls functions with a prototype that takes as many
+    /// arguments as it passes. Anything else is left to the JIT, which also
+    /// reports what is wrong with it.
+    bool canInterpret(const ExprAst &E);
+    /// interpret - the value of E, which canInterpret accepted, or none if
+    /// one of its callees could not be resolved
+    std::optional<double> interpret(const ExprAst &E);
+
+    // what the nodes evaluate themselves with
+
+    /// countNode - false once the expression is too big
+    bool countNode() { return ++Nodes <= MaxNodes; }
+    /// canCall - whether a call to Callee with NumArgs arguments is fine
+    [[nodiscard]] bool canCall(Symbol Callee, size_t NumArgs) const;
+    /// call - run the compiled Callee. If it cannot be found, the whole
+    /// expression fails.
+    double call(Symbol Callee, llvm::ArrayRef<double> Args);
+
+    /// bind/unbind - bring a local into scope, and drop every local bound
+    /// since the scope had Mark of them
+    [[nodiscard]] size_t scope() const { return Vars.size(); }
+    void bind(Symbol Name, double Val) { Vars.emplace_back(Name, Val); }
+    void unbind(size_t Mark) { Vars.truncate(Mark); }
+    /// lookup - the innermost local called Name, or null
+    double *lookup(Symbol Name);
+};
+
+#endif // KALEIDO_INTERPRETER_H
@@ -0,0 +1,159 @@
+//
+// Lexer.cpp - source input, symbol interning and tokenisation
+//
+
+#include "Lexer.h"
+
+#include <charconv>
+#include <cstdio>
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Process.h"
+
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+// Source input
+//===----------------------------------------------------------------------===//
+
+bool SourceBuffer::open(StringRef Path, Diagnostics &Diags) {
+    if (Path == "-" && sys::Process::StandardInIsUserInput()) {
+        Interactive = true;
+        return true;
+    }
+
+    auto BufOrErr = MemoryBuffer::getFileOrSTDIN(Path);
+    if (!BufOrErr) {
+        Diags.error("could not open '" + Path + "': " + BufOrErr.getError().message());
+        return false;
+    }
+    Buffer = std::move(*BufOrErr);
+    CurPtr = Buffer->getBufferStart();
+    BufEnd = Buffer->getBufferEnd();
+    return true;
+}
+
+bool SourceBuffer::refill() {
+    if (!Interactive)
+        return false;
+
+    // waiting on the terminal is not lexing
+    PhaseTimer T(Stats, Phase::Input);
+
+    // read one whole line so no token ever straddles two chunks
+    std::string Line;
+    char Chunk[4096];
+    while (fgets(Chunk, sizeof(Chunk), In)) {
+        Line += Chunk;
+        if (Line.back() == '\n')
+            break;
+    }
+    if (Line.empty())
+        return false;
+
+    CurPtr = Lines.emplace_back(std::move(Line)).data();
+    BufEnd = CurPtr + Lines.back().size();
+    return true;
+}
+
+void SourceBuffer::openMemory(StringRef Text) {
+    Buffer.reset();
+    Lines.clear();
+    Interactive = false;
+    CurPtr = Text.begin();
+    BufEnd = Text.end();
+}
+
+void SourceBuffer::openStream(FILE *F) {
+    Buffer.reset();
+    Lines.clear();
+    Interactive = true;
+    In = F;
+    CurPtr = BufEnd = nullptr;
+}
+
+//===----------------------------------------------------------------------===//
+// Lexer
+//===----------------------------------------------------------------------===//
+
+int Lexer::gettok() {
+    const char *P = Source.cur();
+    const char *End = Source.end();
+
+    // skip any ws and comments, pulling in more input when the chunk runs dry
+    while (true) {
+        while (P != End && isSpace(*P))
+            ++P;
+
+        if (P == End) {
+            // check for eof, dont eat eof
+            if (!Source.refill())
+                return tok_eof;
+            P = Source.cur();
+            End = Source.end();
+            continue;
+        }
+
+        if (*P != '#')
+            break;
+        while (P != End && *P != '\n' && *P != '\r')
+            ++P;
+    }
+
+    const char *Start = P;
+    ++Stats.Tokens;
+
+    // identifier pass
+    if (isAlpha(*P)) {
+        do
+            ++P;
+        while (P != End && isAlnum(*P));
+        Source.setCur(P);
+
+        IdentStr = std::string_view(Start, P - Start);
+        IdentSym = Symbols.intern(IdentStr);
+        switch (IdentSym) {
+            case SymDef:
+                return tok_def;
+            case SymExtern:
+                return tok_extern;
+            case SymIf:
+                return tok_if;
+            case SymThen:
+                return tok_then;
+            case SymElse:
+                return tok_else;
+            case SymFor:
+                return tok_for;
+            case SymIn:
+                return tok_in;
+            case SymVar:
+                return tok_var;
+            default:
+                return tok_ident;
+        }
+    }
+
+    // number pass
+    if (isDigit(*P)) {
+        do
+            ++P;
+        while (P != End && isDigit(*P));
+
+        if (P != End && *P == '.') {
+            do
+                ++P;
+            while (P != End && isDigit(*P));
+        }
+        Source.setCur(P);
+
+        // parse straight out of the buffer
+        std::from_chars(Start, P, NumVal);
+        return tok_num;
+    }
+
+    // otherwise return char as its ascii value
+    Source.setCur(P + 1);
+    return static_cast<unsigned char>(*P);
+}
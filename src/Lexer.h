@@ -0,0 +1,194 @@
+//
+// Lexer.h - source input, symbol interning and tokenisation
+//
+
+#ifndef KALEIDO_LEXER_H
+#define KALEIDO_LEXER_H
+
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/StringSaver.h"
+
+#include "Diagnostics.h"
+#include "Stats.h"
+
+//===----------------------------------------------------------------------===//
+// Source input
+//===----------------------------------------------------------------------===//
+
+/// SourceBuffer - owns the text the lexer walks over. Files go through
+/// MemoryBuffer (which mmaps anything non-trivial), piped stdin is read in
+/// large blocks into a single buffer, and an interactive terminal or socket is
+/// refilled a line at a time so the REPL still answers each line as it is
+/// typed.
+/// Every byte handed out stays alive until the buffer is destroyed, so later
+/// stages can point into it instead of copying.
+class SourceBuffer {
+    RunStats &Stats;
+    std::unique_ptr<llvm::MemoryBuffer> Buffer;
+    // interactive input, one entry per line; deque keeps the older lines in place
+    std::deque<std::string> Lines;
+    const char *CurPtr = nullptr;
+    const char *BufEnd = nullptr;
+    bool Interactive = false;
+    /// In - where interactive lines come from
+    FILE *In = stdin;
+
+public:
+    explicit SourceBuffer(RunStats &Stats) : Stats(Stats) {}
+
+    /// open - map Path, or stdin when Path is "-". Returns false on failure.
+    bool open(llvm::StringRef Path, Diagnostics &Diags);
+
+    /// refill - move on to the next chunk of interactive input. Returns false
+    /// once there is nothing left to read.
+    bool refill();
+
+    [[nodiscard]] bool isInteractive() const { return Interactive; }
+
+    /// cur/end - the unread part of the current chunk
+    [[nodiscard]] const char *cur() const { return CurPtr; }
+    [[nodiscard]] const char *end() const { return BufEnd; }
+    void setCur(const char *P) { CurPtr = P; }
+    /// skipLine - drop the rest of the interactive line being read
+    void skipLine() { CurPtr = BufEnd; }
+
+    /// openMemory - lex Text directly; it must outlive the buffer
+    void openMemory(llvm::StringRef Text);
+    /// openStream - read F a line at a time, as if it were the terminal
+    void openStream(FILE *F);
+};
+
+//===----------------------------------------------------------------------===//
+// Lexer
+//===----------------------------------------------------------------------===//
+
+enum Token {
+    tok_eof = -1,
+
+    // commands
+    tok_def = -2,
+    tok_extern = -3,
+
+    //primary
+    tok_ident = -4,
+    tok_num = -5,
+
+    // control
+    tok_if = -6,
+    tok_then = -7,
+    tok_else = -8,
+    tok_for = -9,
+    tok_in = -10,
+    tok_var = -11,
+};
+
+/// Symbol - dense id for an interned identifier
+using Symbol = unsigned;
+
+/// KnownSymbol - names every SymbolTable interns first, in this order, so
+/// their ids are the same constants in every session
+enum KnownSymbol : Symbol {
+    // keywords, so the lexer can match them by id
+    SymDef,
+    SymExtern,
+    SymIf,
+    SymThen,
+    SymElse,
+    SymFor,
+    SymIn,
+    SymVar,
+    // qualifiers, which only the parser treats as such, after def or extern
+    SymPure,
+    SymMemo,
+    // name of the anonymous function wrapping a top-level expression
+    SymAnon,
+};
+
+/// SymbolTable - interns identifiers so that everything past the lexer
+/// compares and hashes them as integers. Names are kept as spans into the
+/// source buffer, so interning a new identifier does not copy it.
+class SymbolTable {
+    llvm::DenseMap<llvm::StringRef, Symbol> Ids;
+    std::vector<llvm::StringRef> Names;
+    llvm::BumpPtrAllocator Storage;
+public:
+    SymbolTable() {
+        intern("def");
+        intern("extern");
+        intern("if");
+        intern("then");
+        intern("else");
+        intern("for");
+        intern("in");
+        intern("var");
+        intern("pure");
+        intern("memo");
+        intern("__anon_expr");
+    }
+
+    /// intern - Name must outlive the table (a literal or the source buffer)
+    Symbol intern(llvm::StringRef Name) {
+        auto [It, Inserted] = Ids.try_emplace(Name, Names.size());
+        if (Inserted)
+            Names.push_back(Name);
+        return It->second;
+    }
+
+    /// internCopy - like intern, but keeps its own copy of a new Name
+    Symbol internCopy(llvm::StringRef Name) {
+        auto It = Ids.find(Name);
+        if (It != Ids.end())
+            return It->second;
+        return intern(llvm::StringSaver(Storage).save(Name));
+    }
+
+    /// lookup - the id of Name if it has been interned; never adds it, so
+    /// codegen threads can share the table
+    [[nodiscard]] std::optional<Symbol> lookup(llvm::StringRef Name) const {
+        auto It = Ids.find(Name);
+        if (It == Ids.end())
+            return std::nullopt;
+        return It->second;
+    }
+    [[nodiscard]] llvm::StringRef name(Symbol Sym) const { return Names[Sym]; }
+};
+
+/// Lexer - turns a SourceBuffer into tokens, interning identifiers into the
+/// session's symbol table
+class Lexer {
+    SourceBuffer Source;
+    SymbolTable &Symbols;
+    RunStats &Stats;
+
+    // span of the current identifier, pointing into the source buffer
+    std::string_view IdentStr;
+    // interned id of the current identifier
+    Symbol IdentSym = 0;
+    // holds numeric literals
+    double NumVal = 0;
+public:
+    Lexer(SymbolTable &Symbols, RunStats &Stats) : Source(Stats), Symbols(Symbols), Stats(Stats) {}
+
+    [[nodiscard]] SourceBuffer &getSource() { return Source; }
+    [[nodiscard]] SymbolTable &getSymbols() { return Symbols; }
+
+    [[nodiscard]] std::string_view getIdentStr() const { return IdentStr; }
+    [[nodiscard]] Symbol getIdentSym() const { return IdentSym; }
+    [[nodiscard]] double getNumVal() const { return NumVal; }
+
+    // returns the next token from the source buffer
+    int gettok();
+};
+
+#endif // KALEIDO_LEXER_H
@@ -0,0 +1,86 @@
+//
+// ObjectCache.cpp - compiled objects kept on disk across runs
+//
+
+#include "ObjectCache.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA256.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+/// every key starts with this; module identifiers without it are not keys
+static constexpr StringLiteral KeyPrefix = "kaleido-";
+/// bump whenever the code generated for the same input changes
+static constexpr unsigned KeyVersion = 2;
+
+std::string makeCacheKey(StringRef Normalised, OptimizationLevel Level, StringRef Target) {
+    std::string Text;
+    raw_string_ostream OS(Text);
+    OS << KeyVersion << '\0' << LLVM_VERSION_STRING << '\0' << Target << '\0' << 'O' << Level.getSpeedupLevel() << 's'
+       << Level.getSizeLevel() << '\0' << Normalised;
+    OS.flush();
+    auto Hash = SHA256::hash(arrayRefFromStringRef(Text));
+    return (KeyPrefix + toHex(Hash, /*LowerCase=*/true)).str();
+}
+
+std::string DiskObjectCache::defaultDirectory() {
+    SmallString<128> Path;
+    if (!sys::path::cache_directory(Path))
+        return {};
+    sys::path::append(Path, "kaleido");
+    return std::string(Path);
+}
+
+std::unique_ptr<MemoryBuffer> DiskObjectCache::lookup(StringRef Key, StringRef Ext) {
+    SmallString<128> Path(Dir);
+    sys::path::append(Path, Key + Ext);
+    auto Buf = MemoryBuffer::getFile(Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!Buf)
+        return nullptr;
+    return std::move(*Buf);
+}
+
+void DiskObjectCache::store(StringRef Key, MemoryBufferRef Obj, StringRef Ext) {
+    if (sys::fs::create_directories(Dir))
+        return;
+
+    SmallString<128> Tmp(Dir);
+    sys::path::append(Tmp, Key + "-%%%%%%.tmp");
+    int FD;
+    if (sys::fs::createUniqueFile(Tmp, FD, Tmp))
+        return;
+    {
+        raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        OS << Obj.getBuffer();
+        OS.close();
+        if (OS.has_error()) {
+            OS.clear_error();
+            sys::fs::remove(Tmp);
+            return;
+        }
+    }
+
+    SmallString<128> Path(Dir);
+    sys::path::append(Path, Key + Ext);
+    if (sys::fs::rename(Tmp, Path))
+        sys::fs::remove(Tmp);
+}
+
+void DiskObjectCache::notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) {
+    StringRef Key = M->getModuleIdentifier();
+    if (Key.startswith(KeyPrefix))
+        store(Key, Obj);
+}
+
+std::unique_ptr<MemoryBuffer> DiskObjectCache::getObject(const Module *M) {
+    StringRef Key = M->getModuleIdentifier();
+    if (!Key.startswith(KeyPrefix))
+        return nullptr;
+    return lookup(Key);
+}
@@ -0,0 +1,47 @@
+//
+// ObjectCache.h - compiled objects kept on disk across runs
+//
+
+#ifndef KALEIDO_OBJECTCACHE_H
+#define KALEIDO_OBJECTCACHE_H
+
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+/// makeCacheKey - key for code compiled from Normalised at Level for Target,
+/// which describes the triple, CPU and any other codegen options. The LLVM
+/// version is part of it, so an upgrade never reads stale objects.
+std::string makeCacheKey(llvm::StringRef Normalised, llvm::OptimizationLevel Level, llvm::StringRef Target);
+
+/// DiskObjectCache - one object file per key in a directory. Keys are file
+/// names, so the cache needs no index; entries are written to a temporary
+/// file and renamed into place, so concurrent processes can share it.
+///
+/// As an llvm::ObjectCache it only handles modules whose identifier is a key
+/// from makeCacheKey; any other module is always compiled.
+class DiskObjectCache : public llvm::ObjectCache {
+    std::string Dir;
+public:
+    explicit DiskObjectCache(std::string Dir) : Dir(std::move(Dir)) {}
+
+    /// defaultDirectory - kaleido under the user's cache directory, usually
+    /// ~/.cache/kaleido
+    static std::string defaultDirectory();
+
+    /// lookup - the object stored under Key, or null. Ext picks another
+    /// entry kept beside it.
+    std::unique_ptr<llvm::MemoryBuffer> lookup(llvm::StringRef Key, llvm::StringRef Ext = ".o");
+    /// store - keep Obj under Key; failing to write only loses the entry
+    void store(llvm::StringRef Key, llvm::MemoryBufferRef Obj, llvm::StringRef Ext = ".o");
+
+    void notifyObjectCompiled(const llvm::Module *M, llvm::MemoryBufferRef Obj) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override;
+};
+
+#endif // KALEIDO_OBJECTCACHE_H
@@ -0,0 +1,414 @@
+//
+// Parser.cpp - recursive descent parser producing the arena AST
+//
+
+#include "Parser.h"
+
+#include <string>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+
+#include "Stats.h"
+
+using namespace llvm;
+
+int Parser::getNextToken() {
+    PhaseTimer T(Ast.getStats(), Phase::Lex);
+    return CurTok = Lex.gettok();
+};
+
+/// isBuiltinBinop - operators codegen emits itself, which no function can
+/// implement
+static bool isBuiltinBinop(int Op) {
+    return Op == '=' || Op == '<' || Op == '+' || Op == '-' || Op == '*';
+}
+
+bool Parser::RegisterBinop(char Op, int Prec) {
+    if (isAlnum(Op) || isSpace(Op) || StringRef("(),;#.").contains(Op))
+        return false;
+    if (Prec <= 0 || Prec > INT8_MAX)
+        return false;
+    auto Byte = static_cast<unsigned char>(Op);
+    BinopPrecedence[Byte] = static_cast<int8_t>(Prec);
+    if (!isBuiltinBinop(Byte))
+        BinopCallee[Byte] = Lex.getSymbols().internCopy(std::string("binary") + Op);
+    return true;
+}
+
+void Parser::settleBinop(bool Compiled) {
+    if (Pending && !Compiled) {
+        BinopPrecedence[Pending->Op] = Pending->Prec;
+        BinopCallee[Pending->Op] = Pending->Callee;
+    }
+    Pending.reset();
+}
+
+/// GetTokPrecedence - Get the precedence of the pending binop token
+int Parser::GetTokPrecedence() {
+    // keywords and other non-char tokens are negative
+    if (CurTok < 0 || CurTok >= static_cast<int>(BinopPrecedence.size()))
+        return -1;
+
+    // make sure it's a declared binop
+    int TokPrec = BinopPrecedence[CurTok];
+    if (TokPrec <= 0) return -1;
+    return TokPrec;
+}
+
+ExprAst * Parser::LogError(const char *Str) {
+    Diags.error(Str);
+    return nullptr;
+};
+
+PrototypeAst * Parser::LogErrorP(const char *Str) {
+    LogError(Str);
+    return nullptr;
+};
+
+void Parser::recover() {
+    // at a prompt, the rest of the line is what was typed wrong and the next
+    // line is a fresh item, so nothing is waited for
+    SourceBuffer &Source = Lex.getSource();
+    if (Source.isInteractive()) {
+        Source.skipLine();
+        CurTok = ';';
+        return;
+    }
+    while (CurTok != tok_def && CurTok != tok_extern && CurTok != ';' && CurTok != tok_eof)
+        getNextToken();
+}
+
+/// numberexpr ::= number
+ExprAst * Parser::ParseNumExpr() {
+    auto Result = Ast.newNode<NumExprAst>(Lex.getNumVal());
+    getNextToken(); // consume the number
+    return Result;
+};
+
+/// parenexpr ::= '(' expression ')'
+ExprAst * Parser::ParseParenExpr() {
+    getNextToken(); // eat (
+    auto V = ParseExpression();
+    if (!V)
+        return nullptr;
+
+    if (CurTok != ')')
+        return LogError("expected ')'");
+    getNextToken(); // eat )
+    return V;
+};
+
+/// identexpr
+///    ::= ident
+///    ::= ident '(' expression ')'
+ExprAst * Parser::ParseIdentExpr() {
+    Symbol IdName = Lex.getIdentSym();
+
+    getNextToken(); // eat identifier
+
+    if (CurTok != '(') // simple var ref
+        return Ast.newNode<VarExprAst>(IdName);
+
+    // call
+    getNextToken(); // eat (
+    SmallVector<ExprAst *, 8> Args;
+    if (CurTok != ')') {
+        while (true) {
+            if (auto Arg = ParseExpression())
+                Args.push_back(Arg);
+            else
+                return nullptr;
+
+            if (CurTok == ')')
+                break;
+
+            if (CurTok != ',')
+                return LogError("Expected ')' or ',' in argument list");
+            getNextToken();
+        }
+    }
+    // eat the ')'
+    getNextToken();
+
+    return Ast.newNode<CallExprAst>(IdName, Ast.newSpan<ExprAst *>(Args));
+}
+
+/// ifexpr ::= 'if' expression 'then' expression 'else' expression
+ExprAst * Parser::ParseIfExpr() {
+    getNextToken(); // eat if
+
+    auto Cond = ParseExpression();
+    if (!Cond)
+        return nullptr;
+
+    if (CurTok != tok_then)
+        return LogError("expected 'then'");
+    getNextToken(); // eat then
+
+    auto Then = ParseExpression();
+    if (!Then)
+        return nullptr;
+
+    if (CurTok != tok_else)
+        return LogError("expected 'else'");
+    getNextToken(); // eat else
+
+    auto Else = ParseExpression();
+    if (!Else)
+        return nullptr;
+
+    return Ast.newNode<IfExprAst>(Cond, Then, Else);
+}
+
+/// forexpr ::= 'for' ident '=' expression ',' expression (',' expression)? 'in' expression
+ExprAst * Parser::ParseForExpr() {
+    getNextToken(); // eat for
+
+    if (CurTok != tok_ident)
+        return LogError("expected identifier after 'for'");
+    Symbol IdName = Lex.getIdentSym();
+    getNextToken(); // eat identifier
+
+    if (CurTok != '=')
+        return LogError("expected '=' after 'for'");
+    getNextToken(); // eat =
+
+    auto Start = ParseExpression();
+    if (!Start)
+        return nullptr;
+    if (CurTok != ',')
+        return LogError("expected ',' after for start value");
+    getNextToken(); // eat ,
+
+    auto End = ParseExpression();
+    if (!End)
+        return nullptr;
+
+    // the step is optional and defaults to 1.0
+    ExprAst *Step;
+    if (CurTok == ',') {
+        getNextToken(); // eat ,
+        Step = ParseExpression();
+        if (!Step)
+            return nullptr;
+    } else {
+        Step = Ast.newNode<NumExprAst>(1.0);
+    }
+
+    if (CurTok != tok_in)
+        return LogError("expected 'in' after for");
+    getNextToken(); // eat in
+
+    auto Body = ParseExpression();
+    if (!Body)
+        return nullptr;
+
+    return Ast.newNode<ForExprAst>(IdName, Start, End, Step, Body);
+}
+
+/// varexpr ::= 'var' ident ('=' expression)? (',' ident ('=' expression)?)* 'in' expression
+ExprAst * Parser::ParseVarExpr() {
+    getNextToken(); // eat var
+
+    SmallVector<VarBinding, 4> Vars;
+    while (true) {
+        if (CurTok != tok_ident)
+            return LogError("expected identifier after 'var'");
+        Symbol Name = Lex.getIdentSym();
+        getNextToken(); // eat identifier
+
+        // locals without an initialiser start out as 0.0
+        ExprAst *Init;
+        if (CurTok == '=') {
+            getNextToken(); // eat =
+            Init = ParseExpression();
+            if (!Init)
+                return nullptr;
+        } else {
+            Init = Ast.newNode<NumExprAst>(0.0);
+        }
+        Vars.push_back({Name, Init});
+
+        if (CurTok != ',')
+            break;
+        getNextToken(); // eat ,
+    }
+
+    if (CurTok != tok_in)
+        return LogError("expected 'in' after 'var'");
+    getNextToken(); // eat in
+
+    auto Body = ParseExpression();
+    if (!Body)
+        return nullptr;
+
+    return Ast.newNode<VarInExprAst>(Ast.newSpan<VarBinding>(Vars), Body);
+}
+
+/// primary
+///    ::= identexpr
+///    ::= numberexpr
+///    ::= parenexpr
+///    ::= ifexpr
+///    ::= forexpr
+///    ::= varexpr
+ExprAst * Parser::ParsePrimary() {
+    switch (CurTok) {
+        default:
+            return LogError("unknown token when expecting an expression");
+        case tok_ident:
+            return ParseIdentExpr();
+        case tok_num:
+            return ParseNumExpr();
+        case '(':
+            return ParseParenExpr();
+        case tok_if:
+            return ParseIfExpr();
+        case tok_for:
+            return ParseForExpr();
+        case tok_var:
+            return ParseVarExpr();
+    }
+}
+
+/// binoprhs
+///    ::= ('+' primary)*
+ExprAst * Parser::ParseBinopRhs(int ExprPrec, ExprAst * Lhs) {
+    // if this is a binop find its prec
+    while (true) {
+        int TokPrec = GetTokPrecedence();
+        // if this is a binop that binds at least as tightly as the current binop.
+        // consume it, otherwise we are done
+        if (TokPrec < ExprPrec)
+            return Lhs;
+        // we know it is a binop
+        int Binop = CurTok;
+        getNextToken(); // eat binop
+        // parse the primary expression after the binary operator
+        auto Rhs = ParsePrimary();
+        if (!Rhs)
+            return nullptr;
+        // if Binop binds less tightly with Rhs than the operator after Rhs let
+        // the pending op take Rhs as its Lhs
+        int NextPrec = GetTokPrecedence();
+        if (TokPrec < NextPrec) {
+            Rhs = ParseBinopRhs(TokPrec + 1, Rhs);
+            if (!Rhs)
+                return nullptr;
+        }
+        std::optional<Symbol> Callee;
+        if (!isBuiltinBinop(Binop))
+            Callee = BinopCallee[Binop];
+        Lhs = Ast.newNode<BinExprAst>(Binop, Lhs, Rhs, Callee);
+    }
+}
+
+/// expression
+///    ::= primary binoprhs
+///
+ExprAst * Parser::ParseExpression() {
+    auto Lhs = ParsePrimary();
+    if (!Lhs)
+        return nullptr;
+
+    return ParseBinopRhs(0, Lhs);
+}
+
+/// prototype
+///    ::= id '(' id* ')'
+///    ::= 'binary' op number? '(' id id ')'
+PrototypeAst * Parser::ParsePrototype(Symbol Qualifier) {
+    Pending.reset();
+    if (CurTok != tok_ident)
+        return LogErrorP("Expected function name in prototype");
+
+    Symbol FnName = Lex.getIdentSym();
+    getNextToken();
+
+    // like 'binary', the qualifier only counts when a name follows it, so
+    // pure and memo are still ordinary identifiers everywhere else
+    bool Qualified = FnName == Qualifier && CurTok == tok_ident;
+    if (Qualified) {
+        FnName = Lex.getIdentSym();
+        getNextToken();
+    }
+
+    // 'binary' followed by anything but '(' defines that operator, so a
+    // plain function called binary still parses
+    int Op = 0, OpPrec = DefaultUserBinopPrecedence;
+    if (Lex.getSymbols().name(FnName) == "binary" && CurTok != '(') {
+        Op = CurTok;
+        if (Op < 0)
+            return LogErrorP("Expected operator character after 'binary'");
+        if (isBuiltinBinop(Op))
+            return LogErrorP("cannot redefine a built-in operator");
+        FnName = Lex.getSymbols().internCopy(std::string("binary") + static_cast<char>(Op));
+        getNextToken(); // eat the operator
+
+        if (CurTok == tok_num) {
+            double Prec = Lex.getNumVal();
+            if (Prec < 1 || Prec > INT8_MAX || Prec != static_cast<int>(Prec))
+                return LogErrorP("Invalid precedence: must be 1..127");
+            OpPrec = static_cast<int>(Prec);
+            getNextToken(); // eat the precedence
+        }
+    }
+
+    if (CurTok != '(')
+        return LogErrorP("Expected '(' in prototype");
+
+    // read the list of arg names
+    SmallVector<Symbol, 8> ArgNames;
+    while (getNextToken() == tok_ident)
+        ArgNames.push_back(Lex.getIdentSym());
+    if (CurTok != ')')
+        return LogErrorP("Expected ')' in prototype");
+
+    getNextToken(); // eat ')'
+
+    // the operator parses from the next token on, the body included
+    if (Op) {
+        if (ArgNames.size() != 2)
+            return LogErrorP("Invalid number of operands for operator");
+        auto Byte = static_cast<unsigned char>(Op);
+        PendingBinop Previous{Byte, BinopPrecedence[Byte], BinopCallee[Byte]};
+        if (!RegisterBinop(static_cast<char>(Op), OpPrec))
+            return LogErrorP("Invalid operator character");
+        Pending = Previous;
+    }
+
+    return Ast.newNode<PrototypeAst>(FnName, Ast.newSpan<Symbol>(ArgNames), Qualified && Qualifier == SymPure,
+                                     Qualified && Qualifier == SymMemo);
+}
+
+/// definition ::= 'def' 'memo'? prototype expression
+FunctionAst * Parser::ParseDefinition() {
+    PhaseTimer T(Ast.getStats(), Phase::Parse);
+    getNextToken(); // eat def
+    auto Proto = ParsePrototype(SymMemo);
+    if (!Proto) return nullptr;
+
+    if (auto E = ParseExpression())
+        return Ast.newNode<FunctionAst>(Proto, E);
+    settleBinop(false);
+    return nullptr;
+}
+
+/// external ::= 'extern' 'pure'? prototype
+PrototypeAst * Parser::ParseExtern() {
+    PhaseTimer T(Ast.getStats(), Phase::Parse);
+    getNextToken(); // eat extern
+    return ParsePrototype(SymPure);
+}
+
+/// toplevelexpr ::= expression
+FunctionAst * Parser::ParseTopLevelExpr() {
+    PhaseTimer T(Ast.getStats(), Phase::Parse);
+    if (auto E = ParseExpression()) {
+        // make an anonymous proto
+        auto Proto = Ast.newNode<PrototypeAst>(SymAnon, ArrayRef<Symbol>());
+        return Ast.newNode<FunctionAst>(Proto, E);
+    }
+    return nullptr;
+}
@@ -0,0 +1,114 @@
+//
+// Parser.h - recursive descent parser producing the arena AST
+//
+
+#ifndef KALEIDO_PARSER_H
+#define KALEIDO_PARSER_H
+
+#include <array>
+#include <cstdint>
+#include <optional>
+
+#include "AST.h"
+#include "Diagnostics.h"
+#include "Lexer.h"
+
+/// BinopPrecedenceTable - precedence of every binary operator, indexed by the
+/// operator's byte. 0 means the byte is not a binop.
+using BinopPrecedenceTable = std::array<int8_t, 256>;
+
+static constexpr BinopPrecedenceTable DefaultBinopPrecedence = [] {
+    BinopPrecedenceTable T{};
+    // 1 is lowest precedence
+    T['='] = 2;
+    T['<'] = 10;
+    T['+'] = 20;
+    T['-'] = 20;
+    T['*'] = 40; // highest
+    return T;
+}();
+
+/// DefaultUserBinopPrecedence - of a 'def binary' without a precedence
+static constexpr int DefaultUserBinopPrecedence = 30;
+
+/// Parser - recursive descent over the tokens of one Lexer, building nodes in
+/// an AstContext. Each session has its own, operators included.
+class Parser {
+    Lexer &Lex;
+    AstContext &Ast;
+    Diagnostics &Diags;
+
+    /// CurTok is the current token the parser is looking at
+    int CurTok = 0;
+
+    /// BinopPrecedence - holds the precedence for each binary operator
+    BinopPrecedenceTable BinopPrecedence = DefaultBinopPrecedence;
+
+    /// BinopCallee - the 'binary' function each user-defined operator calls,
+    /// interned once when the operator is registered
+    std::array<Symbol, 256> BinopCallee{};
+
+    /// PendingBinop - what the operator registered by the item just parsed
+    /// had before it, to be put back if the item does not compile
+    struct PendingBinop {
+        unsigned char Op;
+        int8_t Prec;
+        Symbol Callee;
+    };
+    std::optional<PendingBinop> Pending;
+public:
+    Parser(Lexer &Lex, AstContext &Ast, Diagnostics &Diags) : Lex(Lex), Ast(Ast), Diags(Diags) {}
+
+    [[nodiscard]] int getCurTok() const { return CurTok; }
+    /// getNextToken - reads another token from the lexer and updates CurTok
+    /// with its results
+    int getNextToken();
+
+    /// RegisterBinop - install (or re-rank) a binary operator at runtime.
+    /// Returns false for bytes the lexer never hands out as operator tokens
+    /// and for precedences outside 1..127. Uses of the operator call
+    /// 'binary' followed by Op.
+    bool RegisterBinop(char Op, int Prec);
+
+    /// settleBinop - an operator prototype registers its operator as soon as
+    /// it parses, so that the body can use it. Once the session knows whether
+    /// the item compiled it keeps the operator or undoes the registration; the
+    /// next prototype keeps it if neither was done.
+    void settleBinop(bool Compiled);
+
+    /// LogError* - These are little helper functions for error handling.
+    ExprAst *LogError(const char *Str);
+    PrototypeAst *LogErrorP(const char *Str);
+
+    /// recover - after a parse error, skip the rest of the item in one go, up
+    /// to the next 'def', 'extern' or ';', so that it is reported only once.
+    /// Interactive input is only skipped to the end of the line, and the
+    /// current token becomes a ';'.
+    void recover();
+
+    /// expression ::= primary binoprhs
+    ExprAst *ParseExpression();
+    /// definition ::= 'def' 'memo'? prototype expression
+    FunctionAst *ParseDefinition();
+    /// external ::= 'extern' 'pure'? prototype
+    PrototypeAst *ParseExtern();
+    /// toplevelexpr ::= expression
+    FunctionAst *ParseTopLevelExpr();
+
+private:
+    int GetTokPrecedence();
+    ExprAst *ParseNumExpr();
+    ExprAst *ParseParenExpr();
+    ExprAst *ParseIdentExpr();
+    ExprAst *ParseIfExpr();
+    ExprAst *ParseForExpr();
+    ExprAst *ParseVarExpr();
+    ExprAst *ParsePrimary();
+    ExprAst *ParseBinopRhs(int ExprPrec, ExprAst *Lhs);
+    /// ParsePrototype - Qualifier is the one that may come first: SymPure
+    /// after extern, SymMemo after def. An operator prototype registers its
+    /// operator until settleBinop says otherwise.
+    PrototypeAst *ParsePrototype(Symbol Qualifier);
+};
+
+#endif // KALEIDO_PARSER_H
@@ -0,0 +1,98 @@
+//
+// Profile.cpp - execution counts for profile-guided optimisation
+//
+
+#include "Profile.h"
+
+#include <vector>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+/// the first line of every profile file
+static constexpr StringLiteral Magic = "kaleido-profile 1";
+
+// The file is text, one definition per line:
+//     <name> <body hash in hex> <counter>...
+Error Profile::load(StringRef Path) {
+    auto Buf = MemoryBuffer::getFile(Path, /*IsText=*/true);
+    if (!Buf)
+        return createStringError(Buf.getError(), "could not open '%s': %s", Path.str().c_str(),
+                                 Buf.getError().message().c_str());
+
+    SmallVector<StringRef, 0> Lines;
+    (*Buf)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+    if (Lines.empty() || Lines.front().rtrim() != Magic)
+        return createStringError(inconvertibleErrorCode(), "'%s' is not a kaleido profile", Path.str().c_str());
+
+    InstrProfSummaryBuilder Builder(std::vector<uint32_t>(ProfileSummaryBuilder::DefaultCutoffs.begin(),
+                                                          ProfileSummaryBuilder::DefaultCutoffs.end()));
+    for (StringRef Line : drop_begin(Lines)) {
+        SmallVector<StringRef, 16> Fields;
+        Line.rtrim().split(Fields, ' ', -1, /*KeepEmpty=*/false);
+        Counts C;
+        bool Ok = Fields.size() >= 3 && !Fields[1].getAsInteger(16, C.Hash);
+        for (unsigned Idx = 2; Ok && Idx < Fields.size(); ++Idx) {
+            uint64_t Value;
+            Ok = !Fields[Idx].getAsInteger(10, Value);
+            C.Values.push_back(Value);
+        }
+        if (!Ok)
+            return createStringError(inconvertibleErrorCode(), "malformed line in profile '%s': %s",
+                                     Path.str().c_str(), Line.str().c_str());
+        Builder.addRecord(InstrProfRecord(std::vector<uint64_t>(C.Values.begin(), C.Values.end())));
+        Loaded[Fields[0]] = std::move(C);
+    }
+    Summary = Builder.getSummary();
+    return Error::success();
+}
+
+bool Profile::write(StringRef Path, Diagnostics &Diags) {
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+    if (EC) {
+        Diags.error("could not open '" + Path + "': " + EC.message());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> Guard(Lock);
+    OS << Magic << '\n';
+    for (auto &Entry : Live) {
+        OS << Entry.getKey() << ' ' << format_hex_no_prefix(Entry.getValue().Hash, 16);
+        for (uint64_t *Slot : Entry.getValue().Slots)
+            OS << ' ' << *Slot;
+        OS << '\n';
+    }
+    return true;
+}
+
+uint64_t *Profile::getCounter(StringRef Name, uint64_t Hash, unsigned Idx) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Counters &C = Live[Name];
+    if (C.Hash != Hash) {
+        C.Hash = Hash;
+        C.Slots.clear();
+    }
+    while (C.Slots.size() <= Idx)
+        C.Slots.push_back(&Slots.emplace_back(0));
+    return C.Slots[Idx];
+}
+
+ArrayRef<uint64_t> Profile::getCounts(StringRef Name, uint64_t Hash) const {
+    auto It = Loaded.find(Name);
+    if (It == Loaded.end() || It->getValue().Hash != Hash)
+        return {};
+    return It->getValue().Values;
+}
+
+Metadata *Profile::getSummary(LLVMContext &Ctx) const {
+    return Summary ? Summary->getMD(Ctx) : nullptr;
+}
@@ -0,0 +1,72 @@
+//
+// Profile.h - execution counts for profile-guided optimisation
+//
+
+#ifndef KALEIDO_PROFILE_H
+#define KALEIDO_PROFILE_H
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/ProfileSummary.h"
+#include "llvm/Support/Error.h"
+
+#include "Diagnostics.h"
+
+/// Profile - per-definition execution counts, both the live counters of
+/// instrumented code and counts loaded from an earlier run.
+///
+/// A definition's counters are, in order: how often it was entered, then
+/// the then/else counts of every if and the body/exit counts of every for in
+/// the order codegen meets them. Counts are matched to a definition by name
+/// and by a hash of its body, so a definition that has changed since the
+/// profile was taken is compiled as if it had none.
+class Profile {
+    /// Slots - storage for every live counter. JIT'd code increments them in
+    /// place, so they never move and are never freed: code for an older body
+    /// of a definition can still be running while its new body is compiled.
+    std::deque<uint64_t> Slots;
+    struct Counters {
+        uint64_t Hash = 0;
+        llvm::SmallVector<uint64_t *, 8> Slots;
+    };
+    llvm::StringMap<Counters> Live;
+    /// Lock - counters are handed out to the REPL's and the lazy CodeGen
+    std::mutex Lock;
+
+    struct Counts {
+        uint64_t Hash = 0;
+        llvm::SmallVector<uint64_t, 8> Values;
+    };
+    llvm::StringMap<Counts> Loaded;
+    /// Summary - the distribution of the loaded counts, which tells the
+    /// inliner and friends what is hot
+    std::unique_ptr<llvm::ProfileSummary> Summary;
+public:
+    /// load - read a profile written by write
+    llvm::Error load(llvm::StringRef Path);
+    /// write - save the live counters to Path. Returns false on failure.
+    bool write(llvm::StringRef Path, Diagnostics &Diags);
+
+    /// getCounter - where counter Idx of the definition Name, whose body
+    /// hashes to Hash, lives. Compiling the same body again keeps adding to
+    /// the same counters; a different body starts from zero.
+    uint64_t *getCounter(llvm::StringRef Name, uint64_t Hash, unsigned Idx);
+
+    /// getCounts - the loaded counts of Name, or none if its body was
+    /// different when they were taken
+    [[nodiscard]] llvm::ArrayRef<uint64_t> getCounts(llvm::StringRef Name, uint64_t Hash) const;
+
+    /// getSummary - the summary of the loaded counts in Ctx, or null
+    [[nodiscard]] llvm::Metadata *getSummary(llvm::LLVMContext &Ctx) const;
+};
+
+#endif // KALEIDO_PROFILE_H
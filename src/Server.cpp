@@ -0,0 +1,100 @@
+//
+// Server.cpp - many REPL sessions over a Unix socket, sharing one library
+//
+
+#include "Server.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <system_error>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+Server::Server(std::unique_ptr<CompilerSession> Library, const SessionOptions &ClientOpts, unsigned Threads)
+        : Library(std::move(Library)), ClientOpts(ClientOpts),
+          Pool(std::make_unique<ThreadPool>(hardware_concurrency(Threads))) {}
+
+Server::~Server() {
+    Pool->wait();
+    if (ListenFD >= 0) {
+        close(ListenFD);
+        unlink(Path.c_str());
+    }
+}
+
+static Error socketError(const char *What, StringRef Path) {
+    std::error_code EC(errno, std::generic_category());
+    return createStringError(EC, "could not %s '%s': %s", What, Path.str().c_str(), EC.message().c_str());
+}
+
+Error Server::listen(StringRef SocketPath) {
+    Path = SocketPath.str();
+    sockaddr_un Addr = {};
+    if (Path.size() >= sizeof(Addr.sun_path))
+        return createStringError(inconvertibleErrorCode(), "socket path '%s' is too long", Path.c_str());
+    Addr.sun_family = AF_UNIX;
+    memcpy(Addr.sun_path, Path.data(), Path.size());
+
+    // a socket left behind by an earlier server, but never any other file
+    struct stat St;
+    if (lstat(Addr.sun_path, &St) == 0 && S_ISSOCK(St.st_mode))
+        unlink(Addr.sun_path);
+
+    ListenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ListenFD < 0)
+        return socketError("create a socket for", Path);
+    if (bind(ListenFD, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0)
+        return socketError("bind", Path);
+    if (::listen(ListenFD, SOMAXCONN) < 0)
+        return socketError("listen on", Path);
+    return Error::success();
+}
+
+Error Server::serve() {
+    // a client that hangs up early must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+    while (true) {
+        int FD = accept4(ListenFD, nullptr, nullptr, SOCK_CLOEXEC);
+        if (FD < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return socketError("accept on", Path);
+        }
+        Pool->async([this, FD] { serveClient(FD); });
+    }
+}
+
+void Server::serveClient(int FD) {
+    FILE *In = fdopen(FD, "r");
+    if (!In) {
+        close(FD);
+        return;
+    }
+    {
+        raw_fd_ostream Out(FD, /*shouldClose=*/false, /*unbuffered=*/false);
+        auto Session = CompilerSession::create(ClientOpts, Library.get());
+        if (Session) {
+            (*Session)->setOutput(Out);
+            (*Session)->openStream(In);
+            (*Session)->run();
+        } else {
+            Out << "Error: " << toString(Session.takeError()) << "\n";
+        }
+        Out.flush();
+        // the client may be gone already; that is not worth more than
+        // dropping what it would have read
+        if (Out.has_error())
+            Out.clear_error();
+    }
+    fclose(In);
+}
@@ -0,0 +1,48 @@
+//
+// Server.h - many REPL sessions over a Unix socket, sharing one library
+//
+
+#ifndef KALEIDO_SERVER_H
+#define KALEIDO_SERVER_H
+
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ThreadPool.h"
+
+#include "CompilerSession.h"
+
+/// Server - accepts connections on a Unix socket and runs a REPL session
+/// for each on a thread pool. The client writes source and reads back what
+/// the REPL prints, diagnostics included, until it closes its end.
+///
+/// Every session is created on top of Library, a finished ShareJIT session:
+/// the library is compiled once and its functions are called in place,
+/// while each client's definitions go into a dylib of its own, so clients
+/// never see or break one another's.
+class Server {
+    std::unique_ptr<CompilerSession> Library;
+    SessionOptions ClientOpts;
+    std::string Path;
+    int ListenFD = -1;
+    /// Pool - last, so that the clients are done before the library goes
+    std::unique_ptr<llvm::ThreadPool> Pool;
+public:
+    /// Server - serve ClientOpts sessions on top of Library, with at most
+    /// Threads clients at a time; 0 means one per core
+    Server(std::unique_ptr<CompilerSession> Library, const SessionOptions &ClientOpts, unsigned Threads);
+    ~Server();
+
+    /// listen - bind the socket at Path, replacing a stale socket there
+    llvm::Error listen(llvm::StringRef Path);
+    /// serve - accept clients until accepting fails
+    llvm::Error serve();
+
+private:
+    /// serveClient - run one session on the connection FD, then close it
+    void serveClient(int FD);
+};
+
+#endif // KALEIDO_SERVER_H
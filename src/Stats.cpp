@@ -0,0 +1,98 @@
+//
+// Stats.cpp - per-phase wall time and compiler counters for -time-report
+//
+
+#include "Stats.h"
+
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static const char *const PhaseNames[] = {
+        "other", "input", "lex", "parse", "fold", "codegen", "verify", "optimize", "link", "jit", "execute", "emit",
+};
+static_assert(std::size(PhaseNames) == static_cast<size_t>(Phase::NumPhases));
+
+RunStats::RunStats() = default;
+RunStats::~RunStats() = default;
+
+void RunStats::enable(bool TimePasses) {
+    Enabled = true;
+    LastSwitch = std::chrono::steady_clock::now();
+    if (TimePasses)
+        PassTimes = std::make_unique<TimePassesHandler>(true);
+}
+
+void RunStats::registerPassTimers(PassInstrumentationCallbacks &PIC) {
+    if (PassTimes)
+        PassTimes->registerCallbacks(PIC);
+}
+
+static double seconds(std::chrono::steady_clock::duration D) {
+    return std::chrono::duration<double>(D).count();
+}
+
+void RunStats::closeCurrentPhase() {
+    if (Enabled)
+        switchTo(Current);
+}
+
+void RunStats::print(raw_ostream &OS) {
+    closeCurrentPhase();
+
+    std::chrono::steady_clock::duration Total{};
+    for (auto D : PhaseTime)
+        Total += D;
+
+    OS << "===" << std::string(73, '-') << "===\n"
+       << "                          kaleido time report\n"
+       << "===" << std::string(73, '-') << "===\n";
+    OS << format("  Total Execution Time: %.4f seconds\n\n", seconds(Total));
+    OS << "   ---Wall Time---  --- Phase ---\n";
+    for (size_t I = 0; I != PhaseTime.size(); ++I) {
+        double S = seconds(PhaseTime[I]);
+        double Pct = Total.count() ? 100.0 * S / seconds(Total) : 0.0;
+        OS << format("   %8.4f (%5.1f%%)  %s\n", S, Pct, PhaseNames[I]);
+    }
+
+    OS << "\n   --- Counters ---\n"
+       << format("   %12llu  tokens lexed\n", (unsigned long long)Tokens)
+       << format("   %12llu  AST nodes allocated\n", (unsigned long long)AstNodes)
+       << format("   %12llu  IR instructions emitted\n", (unsigned long long)IRInstructions)
+       << format("   %12llu  IR instructions after optimization\n", (unsigned long long)OptimizedInstructions)
+       << format("   %12llu  functions compiled\n", (unsigned long long)Functions)
+       << format("   %12llu  object cache hits\n", (unsigned long long)CacheHits)
+       << format("   %12llu  object cache misses\n", (unsigned long long)CacheMisses)
+       << format("   %12llu  expressions interpreted\n", (unsigned long long)Interpreted);
+    OS.flush();
+
+    if (PassTimes)
+        PassTimes->print();
+}
+
+void RunStats::printJSON(raw_ostream &OS) {
+    closeCurrentPhase();
+
+    json::OStream J(OS, 2);
+    J.object([&] {
+        J.attributeObject("phases", [&] {
+            for (size_t I = 0; I != PhaseTime.size(); ++I)
+                J.attribute(PhaseNames[I], seconds(PhaseTime[I]));
+        });
+        J.attributeObject("counters", [&] {
+            J.attribute("tokens", static_cast<int64_t>(Tokens));
+            J.attribute("ast_nodes", static_cast<int64_t>(AstNodes));
+            J.attribute("ir_instructions", static_cast<int64_t>(IRInstructions));
+            J.attribute("optimized_ir_instructions", static_cast<int64_t>(OptimizedInstructions));
+            J.attribute("functions", static_cast<int64_t>(Functions));
+            J.attribute("cache_hits", static_cast<int64_t>(CacheHits));
+            J.attribute("cache_misses", static_cast<int64_t>(CacheMisses));
+            J.attribute("interpreted", static_cast<int64_t>(Interpreted));
+        });
+    });
+    OS << "\n";
+}
@@ -0,0 +1,123 @@
+//
+// Stats.h - per-phase wall time and compiler counters for -time-report
+//
+
+#ifndef KALEIDO_STATS_H
+#define KALEIDO_STATS_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+namespace llvm {
+class PassInstrumentationCallbacks;
+class TimePassesHandler;
+class raw_ostream;
+}
+
+/// Phase - the parts of a run that -time-report tells apart. Time is charged
+/// exclusively: while a nested phase runs (lexing inside parsing, verifying
+/// inside codegen) its parent's clock is stopped.
+enum class Phase : uint8_t {
+    Other,
+    Input,
+    Lex,
+    Parse,
+    Fold,
+    Codegen,
+    Verify,
+    Optimize,
+    Link,
+    JIT,
+    Execute,
+    Emit,
+    NumPhases,
+};
+
+/// RunStats - everything -time-report collects over one session
+class RunStats {
+public:
+    /// timing only happens when enabled; the counters are always kept
+    bool Enabled = false;
+
+    uint64_t Tokens = 0;
+    uint64_t AstNodes = 0;
+    uint64_t IRInstructions = 0;
+    uint64_t OptimizedInstructions = 0;
+    uint64_t Functions = 0;
+    uint64_t CacheHits = 0;
+    uint64_t CacheMisses = 0;
+    uint64_t Interpreted = 0;
+
+    std::array<std::chrono::steady_clock::duration, static_cast<size_t>(Phase::NumPhases)> PhaseTime{};
+    Phase Current = Phase::Other;
+    std::chrono::steady_clock::time_point LastSwitch;
+
+    RunStats();
+    ~RunStats();
+    RunStats(const RunStats &) = delete;
+    RunStats &operator=(const RunStats &) = delete;
+
+    /// switchTo - charge the time since the last switch to the current phase
+    /// and make P current. Returns the phase that was current before.
+    Phase switchTo(Phase P) {
+        auto Now = std::chrono::steady_clock::now();
+        PhaseTime[static_cast<size_t>(Current)] += Now - LastSwitch;
+        LastSwitch = Now;
+        Phase Prev = Current;
+        Current = P;
+        return Prev;
+    }
+
+    /// addCounters - fold in the counters of a codegen worker's RunStats
+    void addCounters(const RunStats &Other) {
+        Tokens += Other.Tokens;
+        AstNodes += Other.AstNodes;
+        IRInstructions += Other.IRInstructions;
+        OptimizedInstructions += Other.OptimizedInstructions;
+        Functions += Other.Functions;
+        CacheHits += Other.CacheHits;
+        CacheMisses += Other.CacheMisses;
+        Interpreted += Other.Interpreted;
+    }
+
+    /// enable - start the clocks; with TimePasses also time individual LLVM
+    /// passes through TimePassesHandler
+    void enable(bool TimePasses);
+
+    /// registerPassTimers - hook the pass timers into a new pipeline's callbacks
+    void registerPassTimers(llvm::PassInstrumentationCallbacks &PIC);
+
+    /// print - the human readable report, including per-pass times
+    void print(llvm::raw_ostream &OS);
+
+    /// printJSON - the same numbers as a JSON object
+    void printJSON(llvm::raw_ostream &OS);
+
+private:
+    /// per-pass timers, shared by every pipeline built during the session
+    std::unique_ptr<llvm::TimePassesHandler> PassTimes;
+
+    /// closeCurrentPhase - charge whatever is running right now before reporting
+    void closeCurrentPhase();
+};
+
+/// PhaseTimer - charges the wall time of its scope to a phase
+class PhaseTimer {
+    RunStats &Stats;
+    Phase Prev = Phase::Other;
+public:
+    PhaseTimer(RunStats &Stats, Phase P) : Stats(Stats) {
+        if (Stats.Enabled)
+            Prev = Stats.switchTo(P);
+    }
+    ~PhaseTimer() {
+        if (Stats.Enabled)
+            Stats.switchTo(Prev);
+    }
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+};
+
+#endif // KALEIDO_STATS_H
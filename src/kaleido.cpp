@@ -0,0 +1,97 @@
+//
+// kaleido.cpp - the C embedding API of kaleido.h over CompilerSession
+//
+
+#include "kaleido.h"
+
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CompilerSession.h"
+
+using namespace llvm;
+
+struct kaleido_session {
+    /// Sources - the text of every kaleido_compile, which the lexer points
+    /// into; it outlives the session
+    std::deque<std::string> Sources;
+    std::unique_ptr<CompilerSession> Session;
+};
+
+/// consumed - report E, if it is an error, the way the REPL would
+template <typename T> static bool consumed(Expected<T> &V) {
+    if (V)
+        return false;
+    logAllUnhandledErrors(V.takeError(), errs(), "kaleido: ");
+    return true;
+}
+
+kaleido_session *kaleido_session_create(int opt_level) {
+    SessionOptions Opts;
+    switch (opt_level) {
+        case 0:
+            Opts.CodeGen.OptLevel = OptimizationLevel::O0;
+            break;
+        case 1:
+            Opts.CodeGen.OptLevel = OptimizationLevel::O1;
+            break;
+        case 3:
+            Opts.CodeGen.OptLevel = OptimizationLevel::O3;
+            break;
+        default:
+            Opts.CodeGen.OptLevel = OptimizationLevel::O2;
+            break;
+    }
+    Opts.Quiet = true;
+    Opts.PrintResults = false;
+    Opts.ErrorLimit = 0;
+
+    auto Session = CompilerSession::create(Opts);
+    if (consumed(Session))
+        return nullptr;
+    return new kaleido_session{{}, std::move(*Session)};
+}
+
+void kaleido_session_destroy(kaleido_session *s) {
+    delete s;
+}
+
+int kaleido_register(kaleido_session *s, const char *name, kaleido_fn fn, unsigned arity) {
+    Diagnostics &Diags = s->Session->getDiagnostics();
+    bool Ok = s->Session->addHostFunction(name, reinterpret_cast<void *>(fn), arity);
+    Diags.flush();
+    return Ok ? 0 : 1;
+}
+
+int kaleido_compile(kaleido_session *s, const char *source) {
+    Diagnostics &Diags = s->Session->getDiagnostics();
+    unsigned Before = Diags.getNumErrors();
+    s->Session->openMemory(s->Sources.emplace_back(source));
+    s->Session->run();
+    Diags.flush();
+    return static_cast<int>(Diags.getNumErrors() - Before);
+}
+
+kaleido_fn kaleido_lookup(kaleido_session *s, const char *name, unsigned arity) {
+    // only hand out pointers whose type the caller has right
+    std::optional<Symbol> Sym = s->Session->getSymbols().lookup(name);
+    const PrototypeAst *Proto = Sym ? s->Session->getCodeGen().getPrototype(*Sym) : nullptr;
+    if (!Proto || Proto->getArgs().size() != arity)
+        return nullptr;
+
+    auto Addr = s->Session->lookupFunction(name);
+    if (consumed(Addr))
+        return nullptr;
+    return reinterpret_cast<kaleido_fn>(*Addr);
+}
+
+kaleido_map_fn kaleido_lookup_map(kaleido_session *s, const char *name) {
+    auto Fn = s->Session->lookupMap(name);
+    if (consumed(Fn))
+        return nullptr;
+    return *Fn;
+}
@@ -0,0 +1,86 @@
+/*
+ * kaleido.h - C interface to code compiled by kaleido
+ *
+ * Every definition `def f(a b ...)` compiles to a C function
+ *
+ *     double f(double a, double b, ...);
+ *
+ * and, unless kaleido ran with -map-wrappers=false, to its map wrapper
+ *
+ *     void f_map(const double *const *cols, double *out, uint64_t n);
+ *
+ * which sets out[i] = f(cols[0][i], cols[1][i], ...) for every i < n, with
+ * one input column per parameter. The loop has the body of f inlined and is
+ * vectorised where the body allows it. Both are plain symbols of the object
+ * file written by -c, and can be looked up in a JIT session by name.
+ *
+ * The kaleido_session functions embed the compiler itself: source is JIT
+ * compiled in the calling process and its functions are called through the
+ * pointers kaleido_lookup returns, at the cost of a plain indirect call. A
+ * session must only be used by one thread at a time; the functions it has
+ * compiled can be called from any thread, except memo definitions and their
+ * callers, whose tables are not synchronised: call those from one thread at
+ * a time too. A pointer stays valid until the
+ * session is destroyed, or until its function or any function it calls,
+ * directly or not, is redefined: redefining a function rebuilds all of its
+ * callers at new addresses, so look them up again afterwards.
+ */
+
+#ifndef KALEIDO_H
+#define KALEIDO_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* kaleido_map_fn - the type of every <name>_map wrapper */
+typedef void (*kaleido_map_fn)(const double *const *cols, double *out, uint64_t n);
+
+/* kaleido_fn - any compiled function; cast it to double (*)(double, ...)
+ * with as many doubles as it has parameters */
+typedef double (*kaleido_fn)(void);
+
+/* kaleido_session - one JIT compiler and everything it has compiled */
+typedef struct kaleido_session kaleido_session;
+
+/* kaleido_session_create - a session optimising at opt_level (0 to 3), or
+ * NULL if the JIT could not be set up */
+kaleido_session *kaleido_session_create(int opt_level);
+void kaleido_session_destroy(kaleido_session *s);
+
+/* kaleido_register - make fn, a host function taking arity doubles, the
+ * definition of name. Source may call it with or without an extern. Returns
+ * 0 on success. */
+int kaleido_register(kaleido_session *s, const char *name, kaleido_fn fn, unsigned arity);
+
+/* kaleido_compile - compile source and run its top-level expressions.
+ * Returns the number of errors, which are reported on stderr. */
+int kaleido_compile(kaleido_session *s, const char *source);
+
+/* kaleido_lookup - the function name, if it exists and takes arity
+ * parameters; NULL otherwise */
+kaleido_fn kaleido_lookup(kaleido_session *s, const char *name, unsigned arity);
+
+/* kaleido_lookup_map - the map wrapper of name, or NULL */
+kaleido_map_fn kaleido_lookup_map(kaleido_session *s, const char *name);
+
+#ifdef __cplusplus
+}
+
+namespace kaleido {
+template <typename Fn> struct FunctionArity;
+template <typename... Args> struct FunctionArity<double(Args...)> {
+    static constexpr unsigned value = sizeof...(Args);
+};
+
+/// lookup - kaleido_lookup with the type spelled out instead of cast, as in
+/// kaleido::lookup<double(double, double)>(S, "f")
+template <typename Fn> inline Fn *lookup(kaleido_session *S, const char *Name) {
+    return reinterpret_cast<Fn *>(kaleido_lookup(S, Name, FunctionArity<Fn>::value));
+}
+} // namespace kaleido
+#endif
+
+#endif /* KALEIDO_H */
@@ -3,587 +3,260 @@
 //
 
 #include <cstdio>
-#include <map>
-#include <utility>
 #include <string>
-
-#include "llvm/ADT/APFloat.h"
-#include "llvm/ADT/STLExtras.h"
-#include "llvm/IR/BasicBlock.h"
-#include "llvm/IR/Constants.h"
-#include "llvm/IR/DerivedTypes.h"
-#include "llvm/IR/Function.h"
-#include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/LLVMContext.h"
-#include "llvm/IR/Module.h"
-#include "llvm/IR/Type.h"
-#include "llvm/IR/Verifier.h"
-#include "llvm/IR/Value.h"
+#include <vector>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CompilerSession.h"
+#include "Server.h"
+#include "Stats.h"
 
 using namespace llvm;
 
-//===----------------------------------------------------------------------===//
-// Lexer
-//===----------------------------------------------------------------------===//
-
-enum Token {
-    tok_eof = -1,
-
-    // commands
-    tok_def = -2,
-    tok_extern = -3,
-
-    //primary
-    tok_ident = -4,
-    tok_num = -5,
-};
-
-// holds the name of an ident
-static std::string IdentStr;
-// holds numeric literals
-static double NumVal;
-
-// returns the next token from std input
-static int gettok() {
-    static int LastChar = ' ';
-
-    // skip any ws
-    while (isspace(LastChar))
-        LastChar = getchar();
-
-    // identifier pass
-    if (isalpha(LastChar)) {
-        IdentStr = std::to_string(LastChar);
-
-        while (isalnum(LastChar = getchar()))
-            IdentStr += std::to_string(LastChar);
-
-        if (IdentStr == "def")
-            return tok_def;
-        if (IdentStr == "extern")
-            return tok_extern;
-        return tok_ident;
-    }
-
-    // number pass
-    if (isdigit(LastChar)) {
-        std::string NumStr;
-        do {
-            NumStr += std::to_string(LastChar);
-            LastChar = getchar();
-        } while (isdigit(LastChar));
-
-        if (LastChar == '.') {
-            do {
-                NumStr += std::to_string(LastChar);
-                LastChar = getchar();
-            } while (isdigit(LastChar));
-        }
-
-        NumVal = strtod(NumStr.c_str(), 0);
-        return tok_num;
-    }
-
-    // comment pass
-    if (LastChar == '#') {
-        do
-            LastChar = getchar();
-        while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-
-        if (LastChar != EOF)
-            return gettok();
-    }
-
-    // check for eof, dont eat eof
-    if (LastChar == EOF)
-        return tok_eof;
-
-    // otherwise return char as its ascii value
-    int ThisChar = LastChar;
-    LastChar = getchar();
-    return ThisChar;
-}
-
-//===----------------------------------------------------------------------===//
-// AST
-//===----------------------------------------------------------------------===//
-
-namespace {
-
-    class ExprAst {
-    public:
-        virtual ~ExprAst() = default;
-
-        virtual llvm::Value *codegen() = 0;
-    };
-
-/// NumberExprAst - Expression class for numeric literals
-    class NumExprAst : public ExprAst {
-        double Val;
-    public:
-        NumExprAst(double Val) : Val(Val) {};
-
-        Value* codegen() override;
-    };
-
-///  VarExprAst - class for refing a var
-    class VarExprAst : public ExprAst {
-        std::string Name;
-    public:
-        VarExprAst(std::string Name) : Name(std::move(Name)) {};
-        Value* codegen() override;
-    };
-
-/// BinExprAst - Expression for binary ops
-    class BinExprAst : public ExprAst {
-        char Op;
-        std::unique_ptr<ExprAst> Lhs, Rhs;
-    public:
-        BinExprAst(char Op, std::unique_ptr<ExprAst> Lhs, std::unique_ptr<ExprAst> Rhs)
-                : Op(Op), Lhs(std::move(Lhs)), Rhs(std::move(Rhs)) {};
-        Value* codegen() override;
-    };
-
-/// CallExprAst - Expression class for function calls
-    class CallExprAst : public ExprAst {
-        std::string Callee;
-        std::vector<std::unique_ptr<ExprAst>> Args;
-    public:
-        CallExprAst(std::string Callee, std::vector<std::unique_ptr<ExprAst>> Args)
-                : Callee(std::move(Callee)), Args(std::move(Args)) {};
-        Value* codegen() override;
-    };
-
-/// PrototypeAst - this class represents the prototype for a function,
-/// which captures its name, and its argument names
-    class PrototypeAst {
-        std::string Name;
-        std::vector<std::string> Args;
-    public:
-        PrototypeAst(std::string Name, std::vector<std::string> Args)
-                : Name(std::move(Name)), Args(std::move(Args)) {};
-
-        [[nodiscard]] const std::string &getName() const { return Name; };
-
-        Function *codegen();
-    };
-
-/// FunctionAst - This class represents a function definition itself
-    class FunctionAst {
-        std::unique_ptr<PrototypeAst> Proto;
-        std::unique_ptr<ExprAst> Body;
-    public:
-        FunctionAst(std::unique_ptr<PrototypeAst> Proto, std::unique_ptr<ExprAst> Body)
-                : Proto(std::move(Proto)), Body(std::move(Body)) {};
-        Function *codegen();
-    };
-
-}
-//===----------------------------------------------------------------------===//
-// Parser
-//===----------------------------------------------------------------------===//
-
-/// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
-/// token the parser is looking at.  getNextToken reads another token from the
-/// lexer and updates CurTok with its results.
-static int CurTok;
-static int getNextToken() {
-    return CurTok = gettok();
-};
-
-/// BinopPrecedence - holds the precedence for each binary operator
-static std::map<char, int> BinopPrecedence = {
-        // 1 is lowest precedence
-        {'<', 10},
-        {'+', 20},
-        {'-', 20},
-        {'*', 40}, // highest
-};
-
-/// GetTokPrecedence - Get the precedence of the pending binop token
-static int GetTokPrecedence() {
-    if (!isascii(CurTok))
-        return -1;
-
-    // make sure it's a declared binop
-    int TokPrec = BinopPrecedence[CurTok];
-    if (TokPrec <= 0) return -1;
-    return TokPrec;
-}
-
-/// LogError* - These are little helper functions for error handling.
-static std::unique_ptr<ExprAst> LogError(const char *Str) {
-    fprintf(stderr, "Error: %s\n", Str);
-    return nullptr;
-};
-
-static std::unique_ptr<PrototypeAst> LogErrorP(const char *Str) {
-    LogError(Str);
-    return nullptr;
-};
-
-static std::unique_ptr<ExprAst> ParseExpression();
-
-/// numberexpr ::= number
-static std::unique_ptr<ExprAst> ParseNumExpr() {
-    auto Result = std::make_unique<NumExprAst>(NumVal);
-    getNextToken(); // consume the number
-    return std::move(Result);
-};
-
-/// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAst> ParseParenExpr() {
-    getNextToken(); // eat (
-    auto V = ParseExpression();
-    if (!V)
-        return nullptr;
-
-    if (CurTok != ')')
-        return LogError("expected ')'");
-    getNextToken(); // eat )
-    return V;
-};
-
-/// identexpr
-///    ::= ident
-///    ::= ident '(' expression ')'
-static std::unique_ptr<ExprAst> ParseIdentExpr() {
-    std::string IdName = IdentStr;
-
-    getNextToken(); // eat identifier
-
-    if (CurTok != '(') // simple var ref
-        return std::make_unique<VarExprAst>(IdName);
-
-    // call
-    getNextToken(); // eat (
-    std::vector<std::unique_ptr<ExprAst>> Args;
-    if (CurTok != ')') {
-        while (true) {
-            if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
-            else
-                return nullptr;
-
-            if (CurTok == ')')
-                break;
-
-            if (CurTok != ',')
-                return LogError("Expected ')' or ',' in argument list");
-            getNextToken();
-        }
-    }
-    // eat the ')'
-    getNextToken();
-
-    return std::make_unique<CallExprAst>(IdName, std::move(Args));
-}
-
-/// primary
-///    ::= identexpr
-///    ::= numberexpr
-///    ::= parenexpr
-static std::unique_ptr<ExprAst> ParsePrimary() {
-    switch (CurTok) {
+static cl::list<std::string> InputFilenames(cl::Positional,
+                                            cl::desc("<input files: one source and any number of .bc libraries>"));
+
+static cl::opt<char> OptLevel("O", cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O2')"),
+                              cl::Prefix, cl::init('2'));
+
+static cl::opt<bool> TimeReport("time-report",
+                                cl::desc("Report wall time per compiler phase, per-pass times and counters at exit"));
+static cl::opt<std::string> TimeReportJSON("time-report-json", cl::desc("Also write the -time-report numbers as JSON"),
+                                           cl::value_desc("filename"));
+
+static cl::opt<bool> MapWrappers("map-wrappers",
+                                 cl::desc("Also emit <name>_map, which applies a definition over arrays (default = on)"),
+                                 cl::init(true));
+
+static cl::opt<std::string> CPU("cpu",
+                                cl::desc("CPU to generate code for, or 'native' for the host "
+                                         "(default: the host when JIT compiling, generic with -c)"),
+                                cl::value_desc("name"));
+static cl::alias MArch("march", cl::desc("Alias for -cpu"), cl::aliasopt(CPU));
+static cl::opt<bool> FastMath("fast-math",
+                              cl::desc("Let floating point + and * be reassociated and contracted into FMAs"));
+
+static cl::opt<bool> Lazy("lazy", cl::desc("Generate code for each definition the first time it is called"));
+
+static cl::opt<bool> Tiered("tiered", cl::desc("Compile definitions at -O0 first, and at -O3 in the background once hot"));
+static cl::opt<unsigned> TierUpThreshold("tier-up-threshold",
+                                         cl::desc("Calls after which -tiered optimises a definition, at least 1 (default = 1000)"),
+                                         cl::init(1000));
+
+static cl::opt<bool> Interpret("interpret",
+                               cl::desc("Evaluate top-level expressions without loops instead of compiling them "
+                                        "(default = on)"),
+                               cl::init(true));
+
+static cl::opt<bool> Cache("cache", cl::desc("Reuse compiled objects from earlier runs, and keep new ones"));
+static cl::opt<std::string> CacheDir("cache-dir", cl::desc("Object cache directory (default: ~/.cache/kaleido)"),
+                                     cl::value_desc("directory"));
+
+static cl::opt<unsigned> ErrorLimit("error-limit",
+                                    cl::desc("Stop reading a file or pipe after this many errors "
+                                             "(0 = no limit, default = 20)"),
+                                    cl::init(20));
+
+static cl::opt<bool> Quiet("q", cl::desc("No prompts or IR echo (default when stdin is not a terminal)"));
+static cl::opt<std::string> EmitBC("emit-bc", cl::desc("Write the compiled definitions to this file as bitcode"),
+                                   cl::value_desc("filename"));
+static cl::opt<std::string> EmitLLVM("emit-llvm", cl::desc("Write the IR of every compiled module to this file"),
+                                     cl::value_desc("filename"));
+
+static cl::opt<std::string> ProfileGenerate("profile-generate",
+                                            cl::desc("Count calls and branches, and write the counts to this file at exit"),
+                                            cl::value_desc("filename"));
+static cl::opt<std::string> ProfileUse("profile-use",
+                                       cl::desc("Optimise for the counts in this file, from --profile-generate"),
+                                       cl::value_desc("filename"));
+
+static cl::opt<bool> CompileOnly("c", cl::desc("Compile the whole input into one native object file instead of running it"));
+static cl::opt<unsigned> Jobs("j",
+                              cl::desc("Threads compiling definitions with -c (0 = one per core, default = 1)"),
+                              cl::Prefix, cl::init(1));
+static cl::opt<std::string> OutputFilename("o", cl::desc("Object file to write with -c (default: input name with .o)"),
+                                           cl::value_desc("filename"));
+
+static cl::opt<std::string> Serve("serve",
+                                  cl::desc("Run a REPL for every client of this Unix socket, on top of the inputs "
+                                           "compiled once as a shared library"),
+                                  cl::value_desc("socket"));
+// a client holds its thread while it is connected, idle or not, so this is
+// not tied to the number of cores
+static cl::opt<unsigned> ServeThreads("serve-threads",
+                                      cl::desc("Clients --serve runs at once (0 = one per core, default = 64)"),
+                                      cl::init(64));
+
+/// getOptLevel - the PassBuilder level selected with -O
+static OptimizationLevel getOptLevel() {
+    switch (OptLevel) {
+        case '0':
+            return OptimizationLevel::O0;
+        case '1':
+            return OptimizationLevel::O1;
+        case '3':
+            return OptimizationLevel::O3;
         default:
-            return LogError("unknown token when expecting an expression");
-        case tok_ident:
-            return ParseIdentExpr();
-        case tok_num:
-            return ParseNumExpr();
-        case '(':
-            return ParseParenExpr();
+            return OptimizationLevel::O2;
     }
 }
 
-/// binoprhs
-///    ::= ('+' primary)*
-static std::unique_ptr<ExprAst> ParseBinopRhs(int ExprPrec, std::unique_ptr<ExprAst> Lhs) {
-    // if this is a binop find its prec
-    while (true) {
-        int TokPrec = GetTokPrecedence();
-        // if this is a binop that binds at least as tightly as the current binop.
-        // consume it, otherwise we are done
-        if (TokPrec < ExprPrec)
-            return Lhs;
-        // we know it is a binop
-        int Binop = CurTok;
-        getNextToken(); // eat binop
-        // parse the primary expression after the binary operator
-        auto Rhs = ParsePrimary();
-        if (!Rhs)
-            return nullptr;
-        // if Binop binds less tightly with Rhs than the operator after Rhs let
-        // the pending op take Rhs as its Lhs
-        int NextPrec = GetTokPrecedence();
-        if (TokPrec < NextPrec) {
-            Rhs = ParseBinopRhs(TokPrec + 1, std::move(Rhs));
-            if (!Rhs)
-                return nullptr;
+/// ReportStats - print the -time-report summary and JSON, if requested. LLVM's
+/// own -stats also asks for the summary, next to LLVM's statistics.
+static void ReportStats(RunStats &Stats) {
+    if (TimeReport || AreStatisticsEnabled())
+        Stats.print(errs());
+
+    if (!TimeReportJSON.empty()) {
+        std::error_code EC;
+        raw_fd_ostream OS(TimeReportJSON, EC, sys::fs::OF_Text);
+        if (EC) {
+            fprintf(stderr, "Error: could not open '%s': %s\n", TimeReportJSON.c_str(), EC.message().c_str());
+            return;
         }
-        Lhs = std::make_unique<BinExprAst>(Binop, std::move(Lhs), std::move(Rhs));
+        Stats.printJSON(OS);
     }
 }
 
-/// expression
-///    ::= primary binoprhs
-///
-static std::unique_ptr<ExprAst> ParseExpression() {
-    auto Lhs = ParsePrimary();
-    if (!Lhs)
-        return nullptr;
-
-    return ParseBinopRhs(0, std::move(Lhs));
-}
-
-/// prototype
-///    ::= id '(' id* ')'
-static std::unique_ptr<PrototypeAst> ParsePrototype() {
-    if (CurTok != tok_ident)
-        return LogErrorP("Expected function name in prototype");
-
-    std::string FnName = IdentStr;
-    getNextToken();
-
-    if (CurTok != '(')
-        return LogErrorP("Expected '(' in prototype");
-
-    // read the list of arg names
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_ident)
-        ArgNames.push_back(IdentStr);
-    if (CurTok != ')')
-        return LogErrorP("Expected ')' in prototype");
-
-    // success
-    getNextToken(); // eat ')'
-
-    return std::make_unique<PrototypeAst>(FnName, std::move(ArgNames));
-}
-
-/// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAst> ParseDefinition() {
-    getNextToken(); // eat def
-    auto Proto = ParsePrototype();
-    if (!Proto) return nullptr;
-
-    if (auto E = ParseExpression())
-        return std::make_unique<FunctionAst>(std::move(Proto), std::move(E));
-    return nullptr;
-}
-
-/// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAst> ParseExtern() {
-    getNextToken(); // eat extern
-    return ParsePrototype();
-}
-
-/// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAst> ParseTopLevelExpr() {
-    if (auto E = ParseExpression()) {
-        // make an anonymous proto
-        auto Proto = std::make_unique<PrototypeAst>("", std::vector<std::string>());
-        return std::make_unique<FunctionAst>(std::move(Proto), std::move(E));
-    }
-    return nullptr;
-}
-
-//===----------------------------------------------------------------------===//
-// Compiler
-//===----------------------------------------------------------------------===//
-
-static std::unique_ptr<LLVMContext> TheContext;
-static std::unique_ptr<IRBuilder<>> Builder;
-static std::unique_ptr<Module> TheModule;
-static std::map<std::string, Value*> NamedValues;
-
-Value* LogErrorV(const char* Str) {
-    LogError(Str);
-    return nullptr;
-}
-
-Value* NumExprAst::codegen() {
-    return ConstantFP::get(*TheContext, APFloat(Val));
-}
-
-Value* VarExprAst::codegen() {
-    Value* V = NamedValues[Name];
-    if (!V)
-        LogErrorV("Unknown variable name");
-    return V;
-}
-
-Value* BinExprAst::codegen() {
-    Value *L = Lhs->codegen();
-    Value *R = Rhs->codegen();
-    if (!L || !R)
-        return nullptr;
-
-    switch (Op) {
-        case '+':
-            return Builder->CreateFAdd(L, R, "addtmp");
-        case '-':
-            return Builder->CreateFSub(L, R, "subtmp");
-        case '*':
-            return Builder->CreateFMul(L, R, "multmp");
-        case '<':
-            L = Builder->CreateFCmpULT(L, R, "cmptmp");
-            // Convert bool 0/1 to double 0.0 or 1.0
-            return Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmp");
-        default:
-            return LogErrorV("invalid binary operator");
-    }
-}
-
-Value* CallExprAst::codegen() {
-    // look up the name in the global module table
-    Function *CalleeF = TheModule->getFunction(Callee);
-    if (!CalleeF)
-        return LogErrorV("Unknown function referenced");
-
-    // if arg mismatch err
-    if (CalleeF->arg_size() != Args.size())
-        return LogErrorV("Incorrect # args passed");
-
-    std::vector<Value *> ArgsV;
-    for (const auto & Arg : Args) {
-        ArgsV.push_back(Arg->codegen());
-        if (!ArgsV.back())
-            return nullptr;
+/// InputFilename - the one source input; "-" for stdin
+static std::string InputFilename = "-";
+/// Libraries - the .bc inputs, loaded before the source is read
+static std::vector<std::string> Libraries;
+
+/// splitInputs - sort the positional inputs into InputFilename and Libraries
+static bool splitInputs() {
+    bool HaveSource = false;
+    for (const std::string &Input : InputFilenames) {
+        if (Input.ends_with(".bc")) {
+            Libraries.push_back(Input);
+            continue;
+        }
+        if (HaveSource) {
+            fprintf(stderr, "Error: more than one source file given\n");
+            return false;
+        }
+        InputFilename = Input;
+        HaveSource = true;
     }
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+    return true;
 }
 
-Function* PrototypeAst::codegen() {
-    // Make the function type: double(double, double) etc
-    std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
-    FunctionType *Ft = FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
-    Function *F = Function::Create(Ft, Function::ExternalLinkage, Name, TheModule.get());
-    unsigned Idx = 0;
-    for (auto &Arg : F->args())
-        Arg.setName(Args[Idx++]);
-    return F;
+/// getOutputFilename - the -o file, or the input name with a .o extension
+static std::string getOutputFilename() {
+    if (!OutputFilename.empty())
+        return OutputFilename;
+    StringRef Base = InputFilename != "-" ? StringRef(InputFilename)
+                     : !Libraries.empty()  ? StringRef(Libraries.front())
+                                           : StringRef("a");
+    SmallString<128> Path(Base);
+    sys::path::replace_extension(Path, "o");
+    return std::string(Path);
 }
 
-Function *FunctionAst::codegen() {
-    // first check for an existing from a previous extern decl
-    Function *TheFunction = TheModule->getFunction(Proto->getName());
-
-    if (!TheFunction)
-        TheFunction = Proto->codegen();
-
-    if (!TheFunction)
-        return nullptr;
-
-    if (!TheFunction->empty())
-        return (Function*)LogErrorV("Function cannot be redefined");
-    // create a new basic block to start insertion into
-    BasicBlock *Bb = BasicBlock::Create(*TheContext, "entry", TheFunction);
-    Builder->SetInsertPoint(Bb);
-
-    // record the function args in the NamedValues map
-    NamedValues.clear();
-    for (auto &Arg : TheFunction->args())
-        NamedValues[std::string(Arg.getName())] = &Arg;
-
-    if (Value *RetVal = Body->codegen()) {
-        // finish off the function
-        Builder->CreateRet(RetVal);
-
-        // validate the generated code, checking for consistency
-        verifyFunction(*TheFunction);
-
-        return TheFunction;
+/// serve - compile the inputs into the library, and serve clients on top
+/// of it until the server fails. Clients are scripts, not prompts.
+static int serve(SessionOptions Opts, ExitOnError &ExitOnErr) {
+    Opts.ShareJIT = true;
+    auto Library = ExitOnErr(CompilerSession::create(Opts));
+    for (const std::string &Lib : Libraries) {
+        if (!Library->loadBitcode(Lib))
+            return 1;
     }
-    // error reading body, remove func
-    TheFunction->eraseFromParent();
-    return nullptr;
+    // with no source, the library is just the .bc inputs
+    if (InputFilename == "-")
+        Library->openMemory("");
+    else if (!Library->openFile(InputFilename))
+        return 1;
+    Library->run();
+    if (Library->getDiagnostics().getNumErrors() || !Library->finishLibrary())
+        return 1;
+    ReportStats(Library->getStats());
+
+    SessionOptions ClientOpts = Opts;
+    ClientOpts.ShareJIT = false;
+    ClientOpts.Quiet = true;
+    ClientOpts.Timing = ClientOpts.TimePasses = false;
+    Server S(std::move(Library), ClientOpts, ServeThreads);
+    ExitOnErr(S.listen(Serve));
+    fprintf(stderr, "Serving on %s\n", Serve.c_str());
+    ExitOnErr(S.serve());
+    return 0;
 }
 
-//===----------------------------------------------------------------------===//
-// Top-Level parsing and JIT driver
-//===----------------------------------------------------------------------===//
-
-static void InitializeModule() {
-    // Open a new context and module.
-    TheContext = std::make_unique<LLVMContext>();
-    TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "kaleido - Kaleidoscope compiler\n");
 
-    // Create a new builder for the module.
-    Builder = std::make_unique<IRBuilder<>>(*TheContext);
-}
-
-static void HandleDefinition() {
-    if (auto FnAST = ParseDefinition()) {
-        if (auto *FnIR = FnAST->codegen()) {
-            fprintf(stderr, "Read function definition:");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
-        }
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
+    if (!splitInputs())
+        return 1;
+    if (OptLevel < '0' || OptLevel > '3') {
+        fprintf(stderr, "Error: invalid optimization level -O%c\n", OptLevel.getValue());
+        return 1;
     }
-}
 
-static void HandleExtern() {
-    if (auto ProtoAST = ParseExtern()) {
-        if (auto *FnIR = ProtoAST->codegen()) {
-            fprintf(stderr, "Read extern: ");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
+    SessionOptions Opts;
+    Opts.Timing = TimeReport || AreStatisticsEnabled() || !TimeReportJSON.empty();
+    Opts.TimePasses = TimeReport;
+    Opts.CodeGen.OptLevel = getOptLevel();
+    Opts.CodeGen.Batch = CompileOnly;
+    Opts.CodeGen.MapWrappers = MapWrappers;
+    Opts.CodeGen.FastMath = FastMath;
+    Opts.CodeGen.CPU = CPU;
+    Opts.Jobs = Jobs;
+    Opts.Lazy = Lazy;
+    Opts.Tiered = Tiered;
+    Opts.TierUpThreshold = TierUpThreshold;
+    Opts.Interpret = Interpret;
+    Opts.ErrorLimit = ErrorLimit;
+    // piped input is a script, not somebody at a prompt
+    Opts.Quiet = Quiet.getNumOccurrences() ? bool(Quiet)
+                                           : InputFilename == "-" && !sys::Process::StandardInIsUserInput();
+    Opts.EmitLLVM = EmitLLVM;
+    Opts.EmitBC = EmitBC;
+    Opts.ProfileGenerate = ProfileGenerate;
+    Opts.ProfileUse = ProfileUse;
+    if (Cache || !CacheDir.empty())
+        Opts.CacheDir = CacheDir.empty() ? DiskObjectCache::defaultDirectory() : std::string(CacheDir);
+    if (CompileOnly)
+        Opts.CodeGen.ModuleName = InputFilename;
+
+    ExitOnError ExitOnErr("kaleido: ");
+    if (!Serve.empty()) {
+        if (CompileOnly) {
+            fprintf(stderr, "Error: --serve cannot be used with -c\n");
+            return 1;
         }
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
+        return serve(Opts, ExitOnErr);
     }
-}
-
-static void HandleTopLevelExpression() {
-    // Evaluate a top-level expression into an anonymous function.
-    if (auto FnAST = ParseTopLevelExpr()) {
-        if (auto *FnIR = FnAST->codegen()) {
-            fprintf(stderr, "Read top-level expression:");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
 
-            // Remove the anonymous expression.
-            FnIR->eraseFromParent();
-        }
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
+    auto Session = ExitOnErr(CompilerSession::create(Opts));
+    for (const std::string &Lib : Libraries) {
+        if (!Session->loadBitcode(Lib))
+            return 1;
     }
-}
-
-/// top ::= definition | external | expression | ';'
-static void MainLoop() {
-    while (true) {
-        fprintf(stderr, "ready> ");
-        switch (CurTok) {
-            case tok_eof:
-                return;
-            case ';': // ignore top-level semicolons.
-                getNextToken();
-                break;
-            case tok_def:
-                HandleDefinition();
-                break;
-            case tok_extern:
-                HandleExtern();
-                break;
-            default:
-                HandleTopLevelExpression();
-                break;
-        }
+    // -c of libraries alone has no source to wait for
+    if (CompileOnly && InputFilename == "-" && !Libraries.empty())
+        Session->openMemory("");
+    else if (!Session->openFile(InputFilename))
+        return 1;
+
+    if (CompileOnly) {
+        bool Ok = Session->compileToObject(getOutputFilename());
+        ReportStats(Session->getStats());
+        return Ok ? 0 : 1;
     }
-}
 
-int main() {
-    fprintf(stderr, "ready> ");
-    getNextToken();
-
-    MainLoop();
+    Session->run();
 
+    ReportStats(Session->getStats());
     return 0;
-}
\ No newline at end of file
+}
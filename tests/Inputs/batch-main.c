@@ -0,0 +1,11 @@
+// batch-main.c - calls the definitions batch.ks compiles with -c
+#include <stdio.h>
+
+double f(double);
+double h(double);
+
+int main(void) {
+    printf("f(4) = %g\n", f(4));
+    printf("h(2) = %g\n", h(2));
+    return 0;
+}
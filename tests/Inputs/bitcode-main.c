@@ -0,0 +1,9 @@
+// bitcode-main.c - calls the definition bitcode.ks compiles against a library
+#include <stdio.h>
+
+double app(double);
+
+int main(void) {
+    printf("app(2) = %g\n", app(2));
+    return 0;
+}
@@ -0,0 +1,14 @@
+// map-main.c - runs the map wrapper map-wrappers.ks compiles with -c
+#include <stdint.h>
+#include <stdio.h>
+
+void axpy_map(const double *const *cols, double *out, uint64_t n);
+
+int main(void) {
+    double a[5] = {1, 2, 3, 4, 5}, x[5] = {10, 20, 30, 40, 50}, y[5] = {1, 1, 1, 1, 1}, out[5];
+    const double *cols[3] = {a, x, y};
+    axpy_map(cols, out, 5);
+    for (int i = 0; i < 5; ++i)
+        printf("%g\n", out[i]);
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * serve-client.c - connects one client to a kaleido --serve socket for each
+ * script given, all before any of them sends anything, then sends the
+ * scripts last first and prints what each client got back, last first
+ *
+ * usage: serve-client SOCKET SCRIPT...
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS 16
+
+/* retries for a few seconds, while the server starts up */
+static int connectTo(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+        close(fd);
+        usleep(50000);
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    int clients = argc - 2;
+    if (clients < 1 || clients > MAX_CLIENTS) {
+        fprintf(stderr, "usage: serve-client SOCKET SCRIPT...\n");
+        return 2;
+    }
+    int fds[MAX_CLIENTS];
+    for (int i = 0; i < clients; ++i) {
+        fds[i] = connectTo(argv[1]);
+        if (fds[i] < 0) {
+            fprintf(stderr, "could not connect to %s: %s\n", argv[1], strerror(errno));
+            return 1;
+        }
+        /* a server that never gets to a client must not hang the test */
+        struct timeval timeout = {10, 0};
+        setsockopt(fds[i], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    int failed = 0;
+    for (int i = clients - 1; i >= 0; --i) {
+        const char *script = argv[i + 2];
+        if (write(fds[i], script, strlen(script)) < 0)
+            failed = 1;
+        shutdown(fds[i], SHUT_WR);
+    }
+    for (int i = clients - 1; i >= 0; --i) {
+        char reply[4096];
+        size_t size = 0;
+        ssize_t n;
+        while (size < sizeof(reply) - 1 && (n = read(fds[i], reply + size, sizeof(reply) - 1 - size)) > 0)
+            size += n;
+        reply[size] = '\0';
+        if (n < 0) {
+            printf("client %d: timed out\n", i);
+            failed = 1;
+        }
+        printf("client %d:\n%s", i, reply);
+        close(fds[i]);
+    }
+    return failed;
+}
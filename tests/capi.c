@@ -0,0 +1,68 @@
+/*
+ * capi.c - the C API end to end: registering host functions, compiling,
+ * looking up functions and map wrappers, and looking up again after a
+ * redefinition
+ */
+
+#include <stdio.h>
+
+#include "kaleido.h"
+
+static int failures = 0;
+
+#define EXPECT(cond)                                                                                                   \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond);                                        \
+            ++failures;                                                                                                \
+        }                                                                                                              \
+    } while (0)
+
+static double host_scale(double x) { return x * 1000; }
+
+typedef double (*fn1)(double);
+typedef double (*fn2)(double, double);
+
+int main(void) {
+    kaleido_session *s = kaleido_session_create(2);
+    EXPECT(s != NULL);
+    if (!s)
+        return 1;
+
+    EXPECT(kaleido_register(s, "scale", (kaleido_fn)host_scale, 1) == 0);
+    EXPECT(kaleido_compile(s, "def f(x y) scale(x) + y;") == 0);
+    fn2 f = (fn2)kaleido_lookup(s, "f", 2);
+    EXPECT(f != NULL);
+    if (f)
+        EXPECT(f(2, 3) == 2003);
+
+    /* the arity has to match, and unknown names are NULL */
+    EXPECT(kaleido_lookup(s, "f", 1) == NULL);
+    EXPECT(kaleido_lookup(s, "nosuch", 1) == NULL);
+
+    /* errors are counted, and leave the session usable */
+    EXPECT(kaleido_compile(s, "def bad(x) nosuch(x);") == 1);
+    EXPECT(kaleido_compile(s, "def g(x) x * 2;") == 0);
+
+    kaleido_map_fn g_map = kaleido_lookup_map(s, "g");
+    EXPECT(g_map != NULL);
+    if (g_map) {
+        double in[3] = {1, 2, 3}, out[3] = {0, 0, 0};
+        const double *cols[1] = {in};
+        g_map(cols, out, 3);
+        EXPECT(out[0] == 2 && out[1] == 4 && out[2] == 6);
+    }
+
+    /* redefining a callee rebuilds its callers, so they are looked up again */
+    EXPECT(kaleido_compile(s, "def h(x) g(x) + 1;") == 0);
+    EXPECT(kaleido_compile(s, "def g(x) x * 3;") == 0);
+    fn1 h = (fn1)kaleido_lookup(s, "h", 1);
+    EXPECT(h != NULL);
+    if (h)
+        EXPECT(h(2) == 7);
+
+    kaleido_session_destroy(s);
+    if (failures)
+        fprintf(stderr, "%d failure(s)\n", failures);
+    return failures != 0;
+}
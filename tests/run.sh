@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# run.sh - runs one test: every line of TEST that starts with "# RUN:" is a
+# shell command, run in order, and the test fails as soon as one does. In a
+# command, %kaleido is the compiler, %FileCheck is FileCheck, %cc is a C
+# compiler, %s is TEST, %S is its directory and %t is a scratch path of the
+# test's own; it and everything named after it are removed first.
+#
+# usage: run.sh TEST KALEIDO FILECHECK CC SCRATCHDIR
+#
+
+Test=$1
+Kaleido=$2
+FileCheck=$3
+CC=$4
+Temp=$5/$(basename "$Test" .ks).tmp
+
+rm -rf "$Temp" "$Temp".*
+mkdir -p "$(dirname "$Temp")"
+
+sed -n 's/^# RUN: *//p' "$Test" | sed -e "s|%kaleido|$Kaleido|g" -e "s|%FileCheck|$FileCheck|g" \
+    -e "s|%cc|$CC|g" -e "s|%s|$Test|g" -e "s|%S|$(dirname "$Test")|g" -e "s|%t|$Temp|g" | while IFS= read -r Command; do
+    echo "RUN: $Command"
+    # a command must not read the rest of the list as its input
+    sh -c "$Command" </dev/null || { echo "FAILED: $Command"; exit 1; }
+done
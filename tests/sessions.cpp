@@ -0,0 +1,117 @@
+//
+// sessions.cpp - two CompilerSessions in one process: the same names defined
+// in both, interleaved on one thread and then compiled on two at once, must
+// never see each other
+//
+
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "llvm/Support/Error.h"
+
+#include "CompilerSession.h"
+
+using namespace llvm;
+
+static int Failures = 0;
+
+#define EXPECT(cond)                                                                                                   \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond);                                        \
+            ++Failures;                                                                                                \
+        }                                                                                                              \
+    } while (0)
+
+using Fn1 = double (*)(double);
+
+/// TestSession - a quiet session and the sources its lexer points into
+struct TestSession {
+    std::deque<std::string> Sources;
+    std::unique_ptr<CompilerSession> Session;
+
+    /// compile - run Text through the session; the number of errors it gave
+    unsigned compile(std::string Text) {
+        Diagnostics &Diags = Session->getDiagnostics();
+        unsigned Before = Diags.getNumErrors();
+        Session->openMemory(Sources.emplace_back(std::move(Text)));
+        Session->run();
+        Diags.flush();
+        return Diags.getNumErrors() - Before;
+    }
+
+    /// call - look up a one argument function and call it, NaN if missing
+    double call(const char *Name, double X) {
+        auto Addr = Session->lookupFunction(Name);
+        if (!Addr) {
+            consumeError(Addr.takeError());
+            return __builtin_nan("");
+        }
+        return reinterpret_cast<Fn1>(*Addr)(X);
+    }
+};
+
+static std::unique_ptr<TestSession> makeSession() {
+    SessionOptions Opts;
+    Opts.Quiet = true;
+    Opts.PrintResults = false;
+    Opts.ErrorLimit = 0;
+    auto Session = CompilerSession::create(Opts);
+    if (!Session) {
+        fprintf(stderr, "could not create a session: %s\n", toString(Session.takeError()).c_str());
+        return nullptr;
+    }
+    return std::unique_ptr<TestSession>(new TestSession{{}, std::move(*Session)});
+}
+
+int main() {
+    auto A = makeSession(), B = makeSession();
+    EXPECT(A && B);
+    if (!A || !B)
+        return 1;
+
+    // the same names, interleaved
+    EXPECT(A->compile("def f(x) x + 1;") == 0);
+    EXPECT(B->compile("def f(x) x * 100;") == 0);
+    EXPECT(A->compile("def g(x) f(x) * 2;") == 0);
+    EXPECT(B->compile("def g(x) f(x) - 1;") == 0);
+    EXPECT(A->call("g", 3) == 8);
+    EXPECT(B->call("g", 3) == 299);
+
+    // operators and definitions belong to the session that made them
+    EXPECT(A->compile("def binary% 5 (a b) a - b;") == 0);
+    EXPECT(B->compile("def h(x) 1 % x;") == 1);
+    EXPECT(A->compile("def h(x) 1 % x;") == 0);
+    EXPECT(A->call("h", 3) == -2);
+
+    // redefining in one session rebuilds only its own callers
+    EXPECT(A->compile("def f(x) x;") == 0);
+    EXPECT(A->call("g", 3) == 6);
+    EXPECT(B->call("g", 3) == 299);
+
+    // compiling on two threads at once
+    auto Compile = [](TestSession &S, int Scale, unsigned &Errors) {
+        for (int I = 0; I != 50; ++I)
+            Errors += S.compile("def k" + std::to_string(I) + "(x) x * " + std::to_string(Scale * I) + ";");
+    };
+    unsigned ErrorsA = 0, ErrorsB = 0;
+    std::thread TA(Compile, std::ref(*A), 1, std::ref(ErrorsA));
+    std::thread TB(Compile, std::ref(*B), 2, std::ref(ErrorsB));
+    TA.join();
+    TB.join();
+    EXPECT(ErrorsA == 0 && ErrorsB == 0);
+    EXPECT(A->call("k49", 1) == 49);
+    EXPECT(B->call("k49", 1) == 98);
+
+    // and one outlives the other
+    A.reset();
+    EXPECT(B->call("k10", 1) == 20);
+    EXPECT(B->call("g", 1) == 99);
+
+    if (Failures)
+        fprintf(stderr, "%d failure(s)\n", Failures);
+    return Failures != 0;
+}